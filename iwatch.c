@@ -22,14 +22,33 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <curses.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <math.h>
 #include <paths.h>
+#include <pthread.h>
+#include <regex.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,10 +59,32 @@
 #include <wctype.h>
 
 #define DEFAULT_INTERVAL 2
-#define MAXLINE 300
+#define DEFAULT_HEAT_TICKS 10
+#define MAXCPUS		1024
+#define NRUNSTATS	16	/* number of the runs for the averages */
+#define PIPELINE_DEPTH	4	/* snapshots queued to the worker */
+#define DEFAULT_FRAME_RATE 10	/* screen updates per second at most */
+#define MAXCLIENTS	64	/* clients of the control socket */
+#define CLIENT_QUEUE	16	/* messages queued to a client */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0	/* SO_NOSIGPIPE or SIGPIPE is ignored */
+#define NO_MSG_NOSIGNAL
+#endif
+#define MAXTHREADS	16	/* threads to compare the lines */
+#define PARALLEL_LINES	8192	/* lines to be compared in the threads */
+#define DIFF_CHUNK	2048	/* lines compared at once by a thread */
+#define DEFAULT_TOP_COUNT 20	/* lines of the sorted view */
+#define ADAPTIVE_BACKOFF	1.5	/* stretch while unchanged */
+#define ADAPTIVE_MAX_BACKOFF	8.0
 #define MAXCOLUMN 180
 #define MAX_COMMAND_LENGTH 128
 
+/* exit status of the headless mode */
+#define EXIT_CHANGED	2	/* the output is changed */
+#define EXIT_MATCHED	3	/* the output matches the pattern */
+#define EXIT_UNMATCHED	4	/* the output doesn't match the pattern */
+#define EXIT_STABLE	5	/* the output is not changed for the ticks */
+
 #define NUM_FRAQ_DIGITS_USEC	6	/* number of fractal digits for usec */
 #define MAX_FRAQ_DIGITS		3	/* max number of fractal digits */
 
@@ -73,7 +114,6 @@ int prefix = -1;		/* command prefix argument */
 int decimal_point = -1;		/* position of decimal point.  */
 
 int pause_status = 0;		/* pause status */
-time_t lastupdate;		/* last updated time */
 int xflag = 0;
 
 #define	addwch(_x)	addnwstr(&(_x), 1);
@@ -83,7 +123,367 @@ static char	 *cmdstr;
 static char	**cmdv;
 static int	  style = A_REVERSE;
 
-typedef wchar_t BUFFER[MAXLINE][MAXCOLUMN + 1];
+/* resource usage of a run of the command */
+struct runstat {
+	double		 wall;		/* in seconds */
+	double		 utime;
+	double		 stime;
+	long		 maxrss;	/* in kilobytes */
+	long		 nvcsw;		/* voluntary context switches */
+	long		 nivcsw;	/* involuntary context switches */
+	int		 status;	/* status from wait4(2) */
+};
+
+/* field of a line of the table: the range of the characters */
+struct cell {
+	short		 start;
+	short		 end;
+};
+
+/*
+ * Output of a run of the command.  This is not modified after it is read,
+ * so that it can be shared by the threads with the reference count.  Only
+ * the fields of the table are added before it is shared, and the index is
+ * added before it is pinned as the baseline.
+ */
+struct snapshot {
+	wchar_t		**buf;			/* lines of the output */
+	uint64_t	*hash;			/* hash of each line */
+	int		 nlines;		/* number of lines */
+	int		 size;			/* lines allocated */
+	uint64_t	 digest;		/* hash of the all lines */
+	time_t		 time;			/* time of the update */
+	u_int		 tick;			/* number of the run */
+	struct runstat	 run;
+	uint64_t	*index;			/* hashes of the lines */
+	size_t		 isize;			/* power of 2 */
+	struct cell	*cells;			/* fields of each line */
+	int		 ncells;		/* fields in a line */
+	uint64_t	*keys;			/* hash of the key field */
+	int		*kindex;		/* line + 1 by the key */
+	size_t		 ksize;			/* power of 2 */
+	u_int		 refcnt;
+};
+
+/* buffer to write the data at once */
+struct wbuf {
+	char		*buf;
+	size_t		 len;
+	size_t		 size;
+};
+
+/*
+ * Cache of the results derived from a line, keyed by the hash of the line.
+ * The entries which are not used in the last 2 ticks are purged when the
+ * table becomes full.
+ */
+struct lcache_entry {
+	uint64_t	 hash;		/* 0 if the entry is empty */
+	u_int		 tick;		/* tick when the entry is used lastly */
+	void		*data;
+};
+
+struct lcache {
+	struct lcache_entry	*entries;
+	size_t			 size;		/* power of 2 */
+	size_t			 count;
+	void			(*free_data)(void *);
+};
+
+/* characters to be highlighted in a line */
+struct span {
+	short		 start;		/* index of the first character */
+	short		 end;		/* index next to the last character */
+	int		 attr;
+};
+#define SPAN_EOL	SHRT_MAX	/* highlight until the end of screen */
+
+struct spans {
+	int		 nspans;
+	struct span	 span[];
+};
+
+/* rule to highlight the text which matches the pattern */
+struct hlrule {
+	char		*spec;		/* style specification */
+	int		 attr;
+	int		 subexp;	/* index of the subexpression in hl_re */
+};
+
+/*
+ * What is displayed for a snapshot: the spans to be highlighted for the
+ * changes from the previous snapshot, made for the modes at that time.
+ */
+struct frame {
+	struct snapshot	*cur;
+	struct snapshot	*prev;
+	struct snapshot	*base;		/* baseline pinned or NULL */
+	reverse_mode_t	 reverse;
+	int		 heat;		/* heat_mode and heat_ticks */
+	int		 heat_ticks;
+	int		*first;		/* first span of each line */
+	struct span	*spans;
+	int		 nspans;
+	u_int		*churn;		/* number of the changes of each line */
+	int		*churn_attr;
+	int		*changed;	/* sorted index of the changed lines */
+	int		 nchanged;
+	int		*top;		/* lines of the sorted view or NULL */
+	int		 ntop;
+	u_int		 serial;
+	struct runstat	 last;		/* resource usage of the last run */
+	struct runstat	 avg;		/* and the averages */
+};
+
+/* lines of a frame to be compared by a thread */
+struct diffjob {
+	struct frame	*f;
+	reverse_mode_t	 reverse;
+	int		 start;		/* range of the lines */
+	int		 end;
+	struct span	*spans;
+	int		 nspans;
+	int		 size;
+	int		*changed;	/* the changed lines in the range */
+	int		 nchanged;
+};
+
+/*
+ * Message to the clients of the control socket.  A message is made once
+ * and shared by the clients which it is sent to.
+ */
+struct message {
+	u_int		 refcnt;
+	size_t		 len;
+	char		 data[];
+};
+
+/* client of the control socket */
+struct client {
+	int		 fd;
+	int		 subscribed;
+	int		 synced;	/* the output is sent */
+	int		 closing;	/* close after the queue is sent */
+	char		 req[64];	/* request being read */
+	size_t		 reqlen;
+	struct message	*queue[CLIENT_QUEUE];
+	int		 qhead;
+	int		 qlen;
+	size_t		 off;		/* sent bytes of the first message */
+};
+
+/* single-producer single-consumer queue without locks */
+struct spsc_queue {
+	void		*slot[PIPELINE_DEPTH];
+	u_int		 head;		/* updated by the consumer */
+	u_int		 tail;		/* updated by the producer */
+};
+
+/* numeric field to be exported */
+struct field {
+	char		*name;
+	int		 column;	/* by the whitespaces from 1 */
+	regex_t		 re;		/* pattern of the line */
+};
+
+/* binary heap of the lines for the sorted view */
+struct topheap {
+	int		*line;
+	int		 n;
+	int		 rest;		/* max-heap of the rest if 1 */
+};
+
+/* characters of a line changed at the tick */
+struct agerun {
+	short		 start;
+	short		 end;
+	u_int		 tick;
+};
+#define HEAT_RUNS	8	/* runs kept for a line */
+
+/* history of the changes of a line */
+struct lineage {
+	u_int		 changed;	/* tick of the last change, 0 if never */
+	u_int		 churn;		/* number of the changes */
+	struct agerun	*runs;		/* sorted by the start, or NULL */
+	int		 nruns;
+};
+
+static u_int		 ticks = 0;	/* number of the command executions */
+static struct lineage	*lineage = NULL;
+static int		 nlineage = 0;
+static int		 lineage_runs = 0;	/* any runs are kept */
+static struct snapshot	*proc_cur = NULL;	/* the snapshots processed */
+static struct snapshot	*proc_prev = NULL;
+static struct frame	*curframe = NULL;	/* frame being displayed */
+
+/*
+ * Baseline pinned by the key or -B.  The lines are compared with it instead
+ * of the previous output.  It is changed only by the main thread.
+ */
+static char		*baseline_path = NULL;
+static struct snapshot	*baseline = NULL;
+static pthread_mutex_t	 baseline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Table mode.  The lines are split into the fields by the columns of the
+ * header, and matched with the lines which have the same key field.
+ */
+static int		 table_key = 0;		/* 0 if not a table */
+static struct cell	 table_cols[MAXCOLUMN / 2];	/* in the header */
+static int		 table_ncols = 0;
+static uint64_t		 table_header = 0;	/* hash of the header */
+static struct lcache	 table_cache = { .free_data = free };
+
+/*
+ * Sorted view of the top lines by the number in a column.  The top lines
+ * are kept in the min-heap of the size top_count and the other lines in
+ * the max-heap, and only the lines whose values are changed are moved in
+ * them.  Used by the thread making frames.
+ */
+static int		 top_column = 0;	/* 0 if not sorted */
+static int		 top_rate = 0;		/* by the change per tick */
+static int		 top_count = DEFAULT_TOP_COUNT;
+static struct snapshot	*top_snap = NULL;	/* the values are of it */
+static double		*top_num = NULL;	/* number of each line */
+static double		*top_oldnum = NULL;	/* and of the last snapshot */
+static double		*top_val = NULL;	/* value to be sorted by */
+static int		*top_pos = NULL;	/* index in a heap or -1 */
+static int		 top_size = 0;		/* lines allocated */
+static struct topheap	 top_heap = { .rest = 0 };
+static struct topheap	 top_rest = { .rest = 1 };
+static struct lcache	 top_cache = { .free_data = free };
+
+/*
+ * Pipeline.  The reader thread runs the command and passes the snapshots
+ * to the worker thread, and the worker passes the frames to the main
+ * thread which paints them.  Only the latest frame is painted.
+ */
+static int		 pipeline = 0;
+static int		 frame_rate = DEFAULT_FRAME_RATE;
+static struct snapshot	*pub_cur = NULL;	/* the last frame made */
+static struct snapshot	*pub_prev = NULL;
+static struct spsc_queue snap_queue;
+static struct frame	*frame_slot = NULL;	/* the latest frame */
+static int		 remake_requested = 0;
+static int		 reader_waiting = 0;	/* for the queue to be popped */
+static int		 reader_pipe[2];	/* to wake up the threads */
+static int		 worker_pipe[2];
+static int		 main_pipe[2];
+static pthread_mutex_t	 interval_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Control socket.  The server thread serves the outputs published by the
+ * worker to the clients, and the viewer gets the outputs from it instead
+ * of executing the command.
+ */
+static char		*server_path = NULL;
+static int		 server_fd = -1;
+static int		 server_pipe[2];
+static pthread_mutex_t	 server_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot	*server_pending = NULL;	/* published by the worker */
+static struct snapshot	*server_cur = NULL;	/* served to the clients */
+static struct message	*server_snapmsg = NULL;	/* server_cur as a message */
+static struct message	*server_diffmsg = NULL;	/* the last change */
+static struct client	*clients[MAXCLIENTS];
+static int		 nclients = 0;
+static char		*viewer_path = NULL;
+static FILE		*viewer_fp = NULL;
+
+/* threads to compare the lines of the large outputs */
+static int		 diff_threads = 0;	/* 0 for the number of cpus */
+static int		 pool_started = 0;
+static pthread_mutex_t	 pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	 pool_done_cond = PTHREAD_COND_INITIALIZER;
+static struct diffjob	*pool_jobs;
+static int		 pool_njobs;
+static int		 pool_next;		/* next job to be taken */
+static int		 pool_done;		/* jobs finished */
+static u_int		 pool_gen = 0;		/* incremented for each run */
+
+static int		 heat_mode = 0;	/* fade the highlight by the age */
+static int		 heat_ticks = DEFAULT_HEAT_TICKS;
+
+/* line filter */
+static char		*filter_str = NULL;
+static regex_t		 filter_re;
+static struct lcache	 filter_cache;
+static int		*view = NULL;	/* lines to be displayed */
+static int		 nview = 0;
+static int		 view_size = 0;
+static int		 view_stale = 1;
+static int		 changes_only = 0;	/* fold the unchanged lines */
+
+/* exit conditions for the headless mode */
+static int		 exit_change = 0;
+static char		*exit_match_str = NULL;
+static int		 exit_unmatch = 0;	/* exit if doesn't match */
+static regex_t		 exit_match_re;
+static struct lcache	 exit_match_cache;
+static int		 exit_stable = 0;
+
+/* adaptive interval */
+static int		 adaptive_pct = 0;	/* max duty cycle in percent */
+static double		 adaptive_backoff = 1.0;
+static struct timeval	 adaptive_interval;
+
+/* settings applied to the command */
+static int		 child_setup = 0;	/* any of the below is set */
+static int		 child_nice = 0;
+static int		 child_ioclass = 0;	/* 0 if not specified */
+static int		 child_iolevel = 4;
+static u_char		 child_cpus[MAXCPUS];	/* cpus to run the command */
+static int		 child_ncpus = 0;
+static char		*child_cgroup = NULL;	/* cgroup v2 directory */
+static char		 child_procs[PATH_MAX];	/* cgroup.procs of it */
+static char		 child_errmsg[MAX_COMMAND_LENGTH + 32];
+static struct child_rlimit {
+	const char	*name;
+	int		 resource;
+	int		 is_size;	/* the limit is given as a size */
+	int		 set;
+	rlim_t		 value;
+} child_rlimits[] = {
+	{ "cpu",	RLIMIT_CPU,	0 },
+	{ "mem",	RLIMIT_AS,	1 },
+	{ "data",	RLIMIT_DATA,	1 },
+};
+
+/* resource usage of the last runs */
+static struct runstat	 runstats[NRUNSTATS];
+static u_int		 nruns = 0;
+static int		 show_runstat = 0;
+static int		 header_lines = 2;	/* lines used by the header */
+
+/* export of the numeric fields */
+static struct field	*fields = NULL;
+static int		 nfields = 0;
+static char		*export_path = NULL;
+static int		 export_prom = 0;	/* Prometheus textfile */
+static int		 export_fd = -1;
+static double		*export_vals = NULL;	/* values of the last tick */
+static struct lcache	 export_cache = { .free_data = free };
+static struct wbuf	 export_buf;
+
+/* log of the differences */
+static char		*difflog_path = NULL;
+static int		 difflog_fd = -1;
+static off_t		 difflog_size = 0;	/* current size of the log */
+static long long	 difflog_maxsize = 0;	/* size to rotate the log */
+static int		 difflog_count = 1;	/* number of the old logs */
+static int		 difflog_errno = 0;	/* failure of the rotation */
+static int		 difflog_sync = 0;	/* fdatasync(2) on each write */
+static struct wbuf	 difflog_buf;
+
+/* highlight rules */
+static struct hlrule	*hlrules = NULL;
+static int		 nhlrules = 0;
+static char		*hl_pattern = NULL;	/* combined pattern of rules */
+static size_t		 hl_nsub = 0;
+static regex_t		 hl_re;
+static regmatch_t	*hl_match = NULL;
+static struct lcache	 hl_cache = { .free_data = free };
 
 #ifndef MAX
 #define MAX(x, y)	((x) > (y) ? (x) : (y))
@@ -98,18 +498,140 @@ typedef wchar_t BUFFER[MAXLINE][MAXCOLUMN + 1];
 #define ctrl(c)		((c) & 037)
 int main(int, char *[]);
 void command_loop(void);
-int display(BUFFER *, BUFFER *, reverse_mode_t);
-void read_result(BUFFER *);
+void pipeline_loop(void);
+void *reader_main(void *);
+void *worker_main(void *);
+void headless_loop(void);
+int display(struct frame *);
+void read_result(struct snapshot *);
 kbd_result_t kbd_command(int);
+kbd_result_t kbd_commands(int, int *);
 void showhelp(void);
+int prompt(const char *, char *, int);
 void untabify(wchar_t *, int);
 void on_signal(int);
 void quit(void);
 void usage(void);
 void set_attr(void);
 void parse_style(void);
+int parse_style_spec(const char *, int, int);
 int get_color_num(const char *s);
 int get_attr_num(const char *s);
+uint64_t line_hash(const wchar_t *);
+struct lcache_entry *lcache_lookup(struct lcache *, uint64_t, u_int, int *);
+void lcache_clear(struct lcache *);
+int line_match(regex_t *, const wchar_t *);
+int cached_match(struct lcache *, regex_t *, struct snapshot *, int);
+int set_filter(const char *);
+void update_view(struct frame *);
+void sync_view(struct frame *);
+int find_change(struct frame *, int);
+int lower_bound(const int *, int, int);
+int diff_line(const wchar_t *, const wchar_t *, reverse_mode_t, struct span *);
+int merge_attr(int, int);
+void merge_span(const struct span *, int *, int, int *);
+void render_line(int, int, const wchar_t *, const int *, int);
+void update_lineage(struct snapshot *, struct snapshot *);
+void update_runs(struct lineage *, const wchar_t *, const wchar_t *, u_int,
+    int);
+int heat_attr(u_int, int);
+int heat_line(const wchar_t *, int, reverse_mode_t, u_int, int, struct span *);
+void wbuf_reserve(struct wbuf *, size_t);
+void wbuf_printf(struct wbuf *, const char *, ...)
+    __attribute__((__format__ (printf, 2, 3)));
+void wbuf_addwcs(struct wbuf *, const wchar_t *);
+int wbuf_flush(struct wbuf *, int);
+long long parse_size(const char *);
+void difflog_open(void);
+void difflog_write(struct snapshot *, struct snapshot *);
+void difflog_line(struct wbuf *, char, const wchar_t *);
+void adapt_interval(const struct runstat *, int);
+void printw_interval(const struct timeval *);
+void record_runstat(const struct runstat *);
+void runstat_average(struct runstat *);
+int format_runstat(char *, size_t, const char *, const struct runstat *);
+int parse_cpulist(const char *, u_char *, int);
+void parse_ionice(const char *);
+void parse_rlimit(const char *);
+void prepare_child(void);
+void setup_child(void);
+void difflog_rotate(void);
+int add_field(const char *);
+int parse_column(const char *, int, double *);
+double *parse_fields(const wchar_t *);
+void export_open(void);
+void export_write(struct snapshot *, struct snapshot *);
+int add_hlrule(const char *);
+void load_hlrules(const char *, const char *);
+void load_hlrule_file(const char *);
+void compile_hlrules(void);
+struct spans *hlrule_match(const wchar_t *);
+struct spans *hlrule_spans(struct snapshot *, int);
+struct snapshot *snapshot_new(void);
+void snapshot_clear(struct snapshot *);
+const wchar_t *snapshot_line(struct snapshot *, int);
+void lineage_reserve(int);
+void diff_chunk(struct diffjob *);
+void pool_run(struct diffjob *, int);
+void pool_work(u_int);
+void *pool_main(void *);
+void spawn_thread(void *(*)(void *));
+struct snapshot *snapshot_ref(struct snapshot *);
+void snapshot_release(struct snapshot *);
+void process_snapshot(struct snapshot *);
+struct frame *make_frame(struct snapshot *, struct snapshot *);
+int frame_stale(struct frame *);
+struct snapshot *load_baseline(const char *);
+void pin_baseline(struct snapshot *);
+int baseline_changed(struct snapshot *, struct snapshot *, int);
+void table_columns(const wchar_t *);
+void split_row(const wchar_t *, struct cell *);
+void table_split(struct snapshot *);
+int table_row(struct snapshot *, struct snapshot *, int);
+int diff_cells(struct snapshot *, int, struct snapshot *, int,
+    reverse_mode_t, struct span *);
+int parse_top(const char *);
+double top_number(struct snapshot *, int);
+int top_less(int, int);
+int top_above(struct topheap *, int, int);
+void top_set(struct topheap *, int, int);
+void top_sift(struct topheap *, int);
+void top_push(struct topheap *, int);
+void top_remove(int);
+void top_place(int);
+void top_update(struct snapshot *);
+void top_lines(struct frame *);
+int top_compar(const void *, const void *);
+void frame_free(struct frame *);
+int spsc_push(struct spsc_queue *, void *);
+void *spsc_pop(struct spsc_queue *);
+void wakeup(int *, char);
+int drain(int *, const char *);
+void get_interval(struct timeval *);
+int paint_due(double *, struct timeval *);
+void make_pipe(int *);
+void snapshot_append(struct snapshot *, const wchar_t *);
+void snapshot_digest(struct snapshot *);
+int diff_hunks(struct wbuf *, struct snapshot *, struct snapshot *);
+void server_open(void);
+void server_publish(struct snapshot *);
+void *server_main(void *);
+void server_update(void);
+void server_accept(void);
+void server_request(struct client *);
+int socket_address(struct sockaddr_un *, const char *);
+int client_read(struct client *);
+int client_write(struct client *);
+int client_send(struct client *, struct message *);
+void client_free(struct client *);
+struct message *message_new(struct wbuf *, const char *, ...)
+    __attribute__((__format__ (printf, 2, 3)));
+void message_release(struct message *);
+struct message *snapshot_message(struct snapshot *);
+void viewer_open(void);
+int viewer_line(FILE *, wchar_t *);
+int viewer_read(FILE *, struct snapshot *, struct snapshot *);
+void *viewer_main(void *);
 
 int
 main(int argc, char *argv[])
@@ -119,18 +641,23 @@ main(int argc, char *argv[])
 	double	 intvl;
 
 	setlocale(LC_ALL, "");
+	if ((s = getenv("IWATCH_HIGHLIGHT")) != NULL)
+		load_hlrules(s, "IWATCH_HIGHLIGHT");
 	/*
 	 * Command line option handling
 	 */
-	while ((ch = getopt(argc, argv, "+i:rewps:c:x")) != -1)
+	while ((ch = getopt(argc, argv,
+	    "+i:rewps:c:xf:H:a:gm:M:S:l:L:FA:un:I:C:T:G:Pj:t:k:K:X:E:B:d:o:O:"))
+	    != -1)
 		switch (ch) {
 		case 'i':
 			intvl = strtod(optarg, &e);
 			if (*optarg == '\0' || *e != '\0')
 				errx(EX_USAGE, "invalid interval: %s", optarg);
 			if (*optarg == '-')
-				errx(EX_USAGE, "interval must be positive: %s",
-					optarg);
+				errx(EX_USAGE,
+				    "interval must not be negative: %s",
+				    optarg);
 			opt_interval.tv_sec = (int)intvl;
 			opt_interval.tv_usec = (u_long)
 			    (intvl * 1000000UL) % 1000000UL;
@@ -156,17 +683,174 @@ main(int argc, char *argv[])
 		case 'x':
 			xflag = 1;
 			break;
+		case 'a':
+			heat_ticks = atoi(optarg);
+			if (heat_ticks <= 0)
+				errx(EX_USAGE, "invalid ticks: %s", optarg);
+			heat_mode = 1;
+			break;
+		case 'f':
+			if (set_filter(optarg) != 0)
+				errx(EX_USAGE, "invalid filter: %s", optarg);
+			break;
+		case 'H':
+			load_hlrule_file(optarg);
+			break;
+		case 'g':
+			exit_change = 1;
+			break;
+		case 'M':
+			exit_unmatch = 1;
+			/* FALLTHROUGH */
+		case 'm':
+			if (exit_match_str != NULL)
+				regfree(&exit_match_re);
+			if (regcomp(&exit_match_re, optarg,
+			    REG_EXTENDED | REG_NOSUB | REG_NEWLINE) != 0)
+				errx(EX_USAGE, "invalid pattern: %s", optarg);
+			exit_match_str = optarg;
+			if (ch == 'm')
+				exit_unmatch = 0;
+			break;
+		case 'l':
+			difflog_path = optarg;
+			break;
+		case 'L':
+			if ((e = strchr(optarg, ':')) != NULL) {
+				*e++ = '\0';
+				difflog_count = atoi(e);
+				if (difflog_count <= 0)
+					errx(EX_USAGE, "invalid count: %s", e);
+			}
+			if ((difflog_maxsize = parse_size(optarg)) <= 0)
+				errx(EX_USAGE, "invalid size: %s", optarg);
+			break;
+		case 'F':
+			difflog_sync = 1;
+			break;
+		case 'n':
+			child_nice = strtol(optarg, &e, 10);
+			if (*optarg == '\0' || *e != '\0')
+				errx(EX_USAGE, "invalid nice: %s", optarg);
+			child_setup = 1;
+			break;
+		case 'I':
+			parse_ionice(optarg);
+			child_setup = 1;
+			break;
+		case 'C':
+#ifndef HAVE_SCHED_SETAFFINITY
+			errx(EX_USAGE, "-C is not supported on this system");
+#endif
+			if ((child_ncpus = parse_cpulist(optarg, child_cpus,
+			    MAXCPUS)) <= 0)
+				errx(EX_USAGE, "invalid cpu list: %s", optarg);
+			child_setup = 1;
+			break;
+		case 'T':
+			parse_rlimit(optarg);
+			child_setup = 1;
+			break;
+		case 'G':
+			child_cgroup = optarg;
+			if (asprintf(&s, "%s/cgroup.procs", optarg) == -1)
+				err(EX_OSERR, "asprintf");
+			if (access(s, W_OK) == -1)
+				err(EX_USAGE, "%s", s);
+			free(s);
+			child_setup = 1;
+			break;
+		case 'u':
+			show_runstat = 1;
+			header_lines = 3;
+			break;
+		case 'A':
+			adaptive_pct = atoi(optarg);
+			if (adaptive_pct <= 0 || adaptive_pct > 100)
+				errx(EX_USAGE, "invalid percentage: %s",
+				    optarg);
+			break;
+		case 'S':
+			exit_stable = atoi(optarg);
+			if (exit_stable <= 0)
+				errx(EX_USAGE, "invalid ticks: %s", optarg);
+			break;
+		case 'P':
+			pipeline = 1;
+			break;
+		case 'X':
+			if (add_field(optarg) != 0)
+				errx(EX_USAGE, "invalid field: %s", optarg);
+			break;
+		case 'E':
+			if (strncmp(optarg, "prom:", 5) == 0) {
+				export_prom = 1;
+				export_path = optarg + 5;
+			} else if (strncmp(optarg, "csv:", 4) == 0)
+				export_path = optarg + 4;
+			else
+				export_path = optarg;
+			break;
+		case 'B':
+			baseline_path = optarg;
+			break;
+		case 'd':
+			table_key = atoi(optarg);
+			if (table_key <= 0 ||
+			    table_key > (int)nitems(table_cols))
+				errx(EX_USAGE, "invalid key column: %s",
+				    optarg);
+			break;
+		case 'o':
+		case 'O':
+			top_rate = (ch == 'O');
+			if (parse_top(optarg) != 0)
+				errx(EX_USAGE, "invalid column: %s", optarg);
+			break;
+		case 'k':
+			server_path = optarg;
+			break;
+		case 'K':
+			viewer_path = optarg;
+			pipeline = 1;
+			break;
+		case 't':
+			frame_rate = atoi(optarg);
+			if (frame_rate <= 0)
+				errx(EX_USAGE, "invalid frame rate: %s",
+				    optarg);
+			break;
+		case 'j':
+			diff_threads = atoi(optarg);
+			if (diff_threads <= 0 || diff_threads > MAXTHREADS)
+				errx(EX_USAGE, "invalid threads: %s", optarg);
+			break;
 		default:
 			usage();
 			exit(EX_USAGE);
 		}
 	argc -= optind;
 	argv += optind;
+	compile_hlrules();
+	if ((export_path == NULL) != (nfields == 0))
+		errx(EX_USAGE, "-X and -E must be given together");
+	if (diff_threads == 0)
+		diff_threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1),
+		    MAXTHREADS);
+
+	/*
+	 * The viewer shows the outputs from the control socket
+	 */
+	if (viewer_path != NULL && (argc > 0 || server_path != NULL ||
+	    exit_change || exit_match_str != NULL || exit_stable > 0)) {
+		usage();
+		exit(EX_USAGE);
+	}
 
 	/*
 	 * Build command string to give to popen
 	 */
-	if (argc <= 0) {
+	if (argc <= 0 && viewer_path == NULL) {
 		usage();
 		exit(EX_USAGE);
 	}
@@ -194,6 +878,25 @@ main(int argc, char *argv[])
 		strlcat(cmdstr, argv[i], cmdsiz);
 	}
 	cmdv[i++] = NULL;
+	if (viewer_path != NULL)
+		viewer_open();
+	if (child_setup)
+		prepare_child();
+
+	/*
+	 * Wait for the condition without the screen if any is given
+	 */
+	if (exit_change || exit_match_str != NULL || exit_stable > 0)
+		headless_loop();
+
+	if (difflog_path != NULL)
+		difflog_open();
+	if (export_path != NULL)
+		export_open();
+	if (server_path != NULL)
+		server_open();
+	if (baseline_path != NULL)
+		pin_baseline(load_baseline(baseline_path));
 
 	/*
 	 * Initialize signal
@@ -215,7 +918,10 @@ main(int argc, char *argv[])
 	/*
 	 * Enter main processing loop and never come back here
 	 */
-	command_loop();
+	if (pipeline)
+		pipeline_loop();
+	else
+		command_loop();
 
 	/* NOTREACHED */
 	abort();
@@ -224,35 +930,66 @@ main(int argc, char *argv[])
 void
 command_loop(void)
 {
-	int		 i, nfds;
-	BUFFER		 buf0, buf1;
+	int		 nfds, pending, delayed = 0, rewait;
+	double		 next_paint = 0;
+	struct snapshot	*snap;
+	struct frame	*f;
 	fd_set		 readfds;
-	struct timeval	 to;
-
-	for (i = 0; ; i++) {
-		BUFFER *cur, *prev;
-
-		if (i == 0) {
-			cur = prev = &buf0;
-		} else if (i % 2 == 0) {
-			cur = &buf0;
-			prev = &buf1;
-		} else {
-			cur = &buf1;
-			prev = &buf0;
-		}
+	struct timeval	 to, wait;
 
-		read_result(cur);
+	for (;;) {
+		snap = snapshot_new();
+		read_result(snap);
+		process_snapshot(snap);
+		pending = 1;
+		/* the outputs faster than the frame rate are not painted */
+		if (!paint_due(&next_paint, NULL))
+			goto input;
 
 redraw:
-		display(cur, prev, reverse_mode);
+		delayed = 0;
+		if (pending) {
+			/*
+			 * compare with the output painted last, so that the
+			 * changes of the outputs not painted are highlighted.
+			 */
+			f = make_frame(proc_cur,
+			    (curframe != NULL)? curframe->cur : proc_prev);
+			frame_free(curframe);
+			curframe = f;
+			pending = 0;
+		} else if (frame_stale(curframe)) {
+			f = make_frame(curframe->cur, curframe->prev);
+			frame_free(curframe);
+			curframe = f;
+		}
+		display(curframe);
 
 input:
-		to = opt_interval;
 		FD_ZERO(&readfds);
 		FD_SET(fileno(stdin), &readfds);
-		nfds = select(1, &readfds, NULL, NULL,
-		    (pause_status)? NULL : &to);
+		if (delayed) {
+			/* redraw for the keys within the frame rate */
+			if (paint_due(&next_paint, &to))
+				goto redraw;
+			if ((nfds = select(1, &readfds, NULL, NULL, &to)) == 0)
+				goto input;
+		} else if (pending) {
+			/* paint the output not painted within the frame rate */
+			if (paint_due(&next_paint, &wait))
+				goto redraw;
+			get_interval(&to);
+			if (pause_status || timercmp(&wait, &to, <)) {
+				if ((nfds = select(1, &readfds, NULL, NULL,
+				    &wait)) == 0)
+					goto redraw;
+			} else
+				nfds = select(1, &readfds, NULL, NULL, &to);
+		} else {
+			get_interval(&to);
+			nfds = select(1, &readfds, NULL, NULL,
+			    (pause_status)? NULL : &to);
+		}
 		if (nfds < 0)
 			switch (errno) {
 			case EINTR:
@@ -267,52 +1004,311 @@ input:
 				perror("select");
 			}
 		else if (nfds > 0) {
-			int ch = getch();
-			kbd_result_t result = kbd_command(ch);
+			kbd_result_t result = kbd_commands(getch(), &rewait);
 
 			switch (result) {
 			case RSLT_UPDATE:	/* update buffer */
 				break;
 			case RSLT_REDRAW:	/* scroll with current buffer */
-				goto redraw;
-			case RSLT_NOTOUCH:	/* silently loop again */
+				if (paint_due(&next_paint, NULL))
+					goto redraw;
+				delayed = 1;
 				goto input;
+			case RSLT_NOTOUCH:	/* silently loop again */
 			case RSLT_ERROR:	/* error */
-				fprintf(stderr, "\007");
 				goto input;
 			}
 		}
 	}
 }
 
+/*
+ * Same as command_loop() but the command is executed by the reader thread
+ * and the frames are made by the worker thread, so that the screen and the
+ * keys are not blocked by a slow command or a large output.
+ */
+void
+pipeline_loop(void)
+{
+	int		 nfds, redraw, delayed = 0, rewait;
+	double		 next_paint = 0;
+	fd_set		 readfds;
+	struct timeval	 to;
+	struct frame	*f;
+
+	make_pipe(reader_pipe);
+	make_pipe(worker_pipe);
+	make_pipe(main_pipe);
+
+	spawn_thread((viewer_path != NULL)? viewer_main : reader_main);
+	spawn_thread(worker_main);
+
+	for (;;) {
+		FD_ZERO(&readfds);
+		FD_SET(fileno(stdin), &readfds);
+		FD_SET(main_pipe[0], &readfds);
+		nfds = select(MAX(fileno(stdin), main_pipe[0]) + 1, &readfds,
+		    NULL, NULL, (delayed)? &to : NULL);
+		redraw = delayed;
+		if (nfds < 0) {
+			if (errno != EINTR) {
+				perror("select");
+				continue;
+			}
+			/* window size is changed.  see command_loop() */
+			doupdate();
+			redraw = 1;
+		} else {
+			if (FD_ISSET(main_pipe[0], &readfds)) {
+				if (drain(main_pipe, "q")) {
+					endwin();
+					errx(EX_UNAVAILABLE, "%s: closed",
+					    viewer_path);
+				}
+				/* paint the latest frame only */
+				f = __atomic_exchange_n(&frame_slot, NULL,
+				    __ATOMIC_ACQ_REL);
+				if (f != NULL) {
+					frame_free(curframe);
+					curframe = f;
+					redraw = 1;
+				}
+			}
+			if (FD_ISSET(fileno(stdin), &readfds)) {
+				switch (kbd_commands(getch(), &rewait)) {
+				case RSLT_UPDATE:
+					wakeup(reader_pipe, 'u');
+					break;
+				case RSLT_REDRAW:
+					redraw = 1;
+					break;
+				case RSLT_NOTOUCH:
+				case RSLT_ERROR:
+					break;
+				}
+				/* wait for the new interval */
+				if (rewait)
+					wakeup(reader_pipe, 'w');
+			}
+		}
+
+		/* redraw within the frame rate */
+		if (redraw && !paint_due(&next_paint, &to)) {
+			delayed = 1;
+			continue;
+		}
+		delayed = 0;
+		if (redraw && curframe != NULL) {
+			if (frame_stale(curframe)) {
+				__atomic_store_n(&remake_requested, 1,
+				    __ATOMIC_RELEASE);
+				wakeup(worker_pipe, 'r');
+			}
+			display(curframe);
+		}
+	}
+}
+
+/* execute the command and queue the snapshots for the worker */
+void *
+reader_main(void *arg)
+{
+	int		 nfds, update;
+	struct snapshot	*snap;
+	struct timeval	 to;
+	fd_set		 readfds;
+
+	for (;;) {
+		snap = snapshot_new();
+		read_result(snap);
+		/* wait for the worker to pop the queue if it is behind */
+		update = 0;
+		while (spsc_push(&snap_queue, snap) != 0) {
+			__atomic_store_n(&reader_waiting, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (spsc_push(&snap_queue, snap) == 0)
+				break;
+			FD_ZERO(&readfds);
+			FD_SET(reader_pipe[0], &readfds);
+			if (select(reader_pipe[0] + 1, &readfds, NULL, NULL,
+			    NULL) > 0 && drain(reader_pipe, "u"))
+				update = 1;
+		}
+		__atomic_store_n(&reader_waiting, 0, __ATOMIC_RELAXED);
+		wakeup(worker_pipe, 's');
+		if (update)
+			continue;	/* updated while waiting */
+
+		do {
+			get_interval(&to);
+			FD_ZERO(&readfds);
+			FD_SET(reader_pipe[0], &readfds);
+			nfds = select(reader_pipe[0] + 1, &readfds, NULL, NULL,
+			    (__atomic_load_n(&pause_status, __ATOMIC_RELAXED))?
+			    NULL : &to);
+			/* 'u' is to update now, 'w' is to wait again */
+		} while (nfds != 0 && !drain(reader_pipe, "u"));
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * Process the queued snapshots and pass the frame to the main thread.  The
+ * frames are made at the frame rate at most.
+ */
+void *
+worker_main(void *arg)
+{
+	int		 pending = 0;
+	double		 next_paint = 0;
+	struct snapshot	*snap, *base;
+	struct frame	*f;
+	struct timeval	 to;
+	fd_set		 readfds;
+
+	for (;;) {
+		FD_ZERO(&readfds);
+		FD_SET(worker_pipe[0], &readfds);
+		if (select(worker_pipe[0] + 1, &readfds, NULL, NULL,
+		    (pending)? &to : NULL) < 0)
+			continue;
+		drain(worker_pipe, NULL);
+
+		while ((snap = spsc_pop(&snap_queue)) != NULL) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_exchange_n(&reader_waiting, 0,
+			    __ATOMIC_RELAXED))
+				wakeup(reader_pipe, 'p');
+			process_snapshot(snap);
+			pending = 1;
+		}
+		if (pending && paint_due(&next_paint, &to)) {
+			/*
+			 * Compare with the output of the frame painted last.
+			 * If the last frame is not painted yet, it is replaced
+			 * and compared with the same as it.
+			 */
+			if ((f = __atomic_exchange_n(&frame_slot, NULL,
+			    __ATOMIC_ACQ_REL)) != NULL)
+				base = snapshot_ref(pub_prev);
+			else
+				base = snapshot_ref((pub_cur != NULL)?
+				    pub_cur : proc_prev);
+			frame_free(f);
+			snapshot_release(pub_cur);
+			snapshot_release(pub_prev);
+			pub_cur = snapshot_ref(proc_cur);
+			pub_prev = base;
+			pending = 0;
+			__atomic_store_n(&remake_requested, 0,
+			    __ATOMIC_RELAXED);
+		} else if (!__atomic_exchange_n(&remake_requested, 0,
+		    __ATOMIC_ACQ_REL) || pub_cur == NULL)
+			continue;
+
+		f = make_frame(pub_cur, pub_prev);
+		/* the frame which is not painted yet is replaced */
+		frame_free(__atomic_exchange_n(&frame_slot, f,
+		    __ATOMIC_ACQ_REL));
+		wakeup(main_pipe, 'f');
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * Execute the command periodically until the exit condition is met.  The
+ * screen is not used.
+ */
+void
+headless_loop(void)
+{
+	int			 i, j, matched = 0, stable = 0;
+	uint64_t		 last = 0;
+	struct timeval		 tv;
+	struct timespec		 ts;
+	static struct snapshot	 snap;
+
+	for (i = 0; ; i++) {
+		read_result(&snap);
+		if (i > 0 && snap.digest != last) {
+			if (exit_change)
+				exit(EXIT_CHANGED);
+			stable = 0;
+		} else if (i > 0)
+			stable++;
+
+		if (exit_match_str != NULL && (i == 0 || snap.digest != last)) {
+			for (matched = 0, j = 0; !matched && j < snap.nlines;
+			    j++)
+				matched = cached_match(&exit_match_cache,
+				    &exit_match_re, &snap, j);
+		}
+		if (exit_match_str != NULL && matched != exit_unmatch)
+			exit((exit_unmatch)? EXIT_UNMATCHED : EXIT_MATCHED);
+		if (exit_stable > 0 && stable >= exit_stable)
+			exit(EXIT_STABLE);
+		if (adaptive_pct > 0)
+			adapt_interval(&snap.run,
+			    i == 0 || snap.digest != last);
+		last = snap.digest;
+
+		get_interval(&tv);
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+}
+
 int
-display(BUFFER * cur, BUFFER * prev, reverse_mode_t reverse)
+display(struct frame *f)
 {
-	int	 i, val, screen_x, screen_y, cw, line, rl;
-	char	*ct;
+	int		 i, st, stale, screen_x, screen_y, line, row;
+	char		*ct, buf[BUFSIZ];
+	reverse_mode_t	 reverse = reverse_mode;
+	struct snapshot	*cur = f->cur, *prev = f->prev, *base;
+	struct timeval	 intvl, adaptive;
+
+	sync_view(f);
+
+	pthread_mutex_lock(&interval_lock);
+	intvl = opt_interval;
+	adaptive = adaptive_interval;
+	pthread_mutex_unlock(&interval_lock);
 
 	erase();
 
 	move(0, 0);
-	if ((int)strlen(cmdstr) > COLS - 47)
-		printw("\"%-.*s..\" ", COLS - 49, cmdstr);
+	i = (adaptive_pct > 0)? 59 : 47;	/* space for the interval */
+	if ((int)strlen(cmdstr) > COLS - i)
+		printw("\"%-.*s..\" ", COLS - i - 2, cmdstr);
 	else
 		printw("\"%s\" ", cmdstr);
 	if (pause_status)
 		printw("--PAUSE--");
-	else if (opt_interval.tv_sec == 1 && opt_interval.tv_usec == 0)
+	else if (viewer_path != NULL)
+		printw("from the control socket");
+	else if (!timerisset(&intvl))
+		printw("continuously");
+	else if (intvl.tv_sec == 1 && intvl.tv_usec == 0)
 		printw("on every second");
-	else if (opt_interval.tv_usec == 0)
-		printw("on every %d seconds", (int)opt_interval.tv_sec);
 	else {
-		for (i = NUM_FRAQ_DIGITS_USEC, val = opt_interval.tv_usec;
-		    val % 10 == 0; val /= 10)
-			i--;
-		printw("on every %d.%0*d seconds",
-		    (int)opt_interval.tv_sec, i, val);
+		printw("on every ");
+		printw_interval(&intvl);
+		printw(" seconds");
+	}
+	if (!pause_status && adaptive_pct > 0 &&
+	    timercmp(&adaptive, &intvl, !=)) {
+		printw(" (now ");
+		printw_interval(&adaptive);
+		printw(")");
 	}
 
-	ct = ctime(&lastupdate);
+	ct = ctime(&cur->time);
 	ct[24] = '\0';
 	move(0, COLS - strlen(ct));
 	addstr(ct);
@@ -325,12 +1321,15 @@ display(BUFFER * cur, BUFFER * prev, reverse_mode_t reverse)
 		if (reverse == SWITCH) attrset(A_NORMAL);	\
 	} while (0/* CONSTCOND */)
 
-	move(1, COLS - 47);
+	move(1, COLS - 54);
 	printw("Reverse mode:");
 	MODELINE(" [w]", REVERSE_WORD, "word");
 	MODELINE(" [e]", REVERSE_LINE, "line");
 	MODELINE(" [r]", REVERSE_CHAR, "char");
-	printw(" [t]toggle");
+	printw(" [t]toggle [a]");
+	if (heat_mode) attron(style);
+	printw("age");
+	if (heat_mode) attrset(A_NORMAL);
 
 	move(1, 1);
 	if (prefix >= 0) {
@@ -350,116 +1349,118 @@ display(BUFFER * cur, BUFFER * prev, reverse_mode_t reverse)
 
 	if (start_line != 0 || start_column != 0)
 		printw("(%d, %d)", start_line, start_column);
+	if (changes_only) {
+		getyx(stdscr, screen_y, screen_x);
+		if (screen_x + 16 < COLS - 55)
+			printw(" %d changed", f->nchanged);
+	}
+	if (baseline != NULL) {
+		getyx(stdscr, screen_y, screen_x);
+		if (screen_x + 18 < COLS - 55) {
+			strftime(buf, sizeof(buf), "%H:%M:%S",
+			    localtime(&baseline->time));
+			printw(" baseline %s", buf);
+		}
+	}
+	if (filter_str != NULL) {
+		getyx(stdscr, screen_y, screen_x);
+		if (screen_x + 3 < COLS - 55)
+			printw(" /%.*s/", COLS - 55 - screen_x - 3,
+			    filter_str);
+	}
+
+	if (f->last.status != 0) {
+		st = f->last.status;
+		getyx(stdscr, screen_y, screen_x);
+		if (screen_x + 12 < COLS - 55) {
+			attron(style);
+			if (WIFSIGNALED(st))
+				printw(" signal %d", WTERMSIG(st));
+			else
+				printw(" exit %d", WEXITSTATUS(st));
+			attrset(A_NORMAL);
+		}
+	}
+	if ((i = __atomic_load_n(&difflog_errno, __ATOMIC_RELAXED)) != 0) {
+		getyx(stdscr, screen_y, screen_x);
+		if (screen_x + 6 < COLS - 55) {
+			attron(style);
+			printw(" log: %.*s", COLS - 55 - screen_x - 6,
+			    strerror(i));
+			attrset(A_NORMAL);
+		}
+	}
+	if (show_runstat) {
+		i = format_runstat(buf, sizeof(buf), "last", &f->last);
+		format_runstat(buf + i, sizeof(buf) - i, "   avg", &f->avg);
+		mvaddnstr(2, 1, buf, COLS - 2);
+	}
 
-	if (!prev || (cur == prev))
+	if (cur == prev && baseline == NULL)
 		reverse = REVERSE_NONE;
+	/* the frame made for the other modes is used until it is remade */
+	stale = frame_stale(f);
 
-	for (line = start_line, screen_y = 2;
-	    screen_y < LINES && line < MAXLINE && (*cur)[line][0];
-	    line++, screen_y++) {
-		wchar_t	*cur_line, *prev_line, *p, *pp;
-
-		rl = 0;	/* reversing line */
-		cur_line = (*cur)[line];
-		prev_line = (*prev)[line];
-
-		for (p = cur_line, cw = 0; cw < start_column; p++)
-			cw += WCWIDTH(*p);
-		screen_x = cw - start_column;
-		for (pp = prev_line, cw = 0; cw < start_column; pp++)
-			cw += WCWIDTH(*pp);
-
-		switch (reverse) {
-		case REVERSE_LINE:
-			if (wcscmp(cur_line, prev_line)) {
-				attron(style);
-				rl = 1;
-				for (i = 0; i < screen_x; i++) {
-					move(screen_y, i);
-					addch(' ');
-				}
-			}
-			/* FALLTHROUGH */
+	for (row = start_line, screen_y = header_lines;
+	    screen_y < LINES && row < nview; row++, screen_y++) {
+		int		 attrs[MAXCOLUMN + 1], fill, nspans, len, x0;
+		struct span	 spans[MAXCOLUMN + 1];
+		struct spans	*hls;
 
-		case REVERSE_NONE:
-			move(screen_y, screen_x);
-			while (screen_x < COLS) {
-				if (*p && *p != L'\n') {
-					cw = wcwidth(*p);
-					if (screen_x + cw >= COLS)
-						break;
-					addwch(*p++);
-					pp++;
-					screen_x += cw;
-				} else if (rl) {
-					addch(' ');
-					screen_x++;
-				} else
-					break;
-			}
+		if ((line = view[row]) < 0) {
+			/* the unchanged lines folded */
+			attrset(A_DIM);
+			mvprintw(screen_y, 0, "... %d unchanged ...", -line);
 			attrset(A_NORMAL);
-			break;
+			continue;
+		}
+		for (len = 0; cur->buf[line][len] != L'\0' &&
+		    cur->buf[line][len] != L'\n'; len++)
+			attrs[len] = A_NORMAL;
+		fill = A_NORMAL;
 
-		case REVERSE_WORD:
-		case REVERSE_CHAR:
-			move(screen_y, screen_x);
-			while (*p && screen_x < COLS) {
-				cw = wcwidth(*p);
-				if (screen_x + cw >= COLS)
-					break;
-				if (*p == *pp) {
-					addwch(*p++);
-					pp++;
-					screen_x += cw;
-					continue;
-				}
-				/*
-				 * This method to reverse by word unit is not
-				 * very fancy but it was easy to implement.  If
-				 * you are urged to rewrite this algorithm, it
-				 * is right thing and don't hesitate to do so!
-				 */
-				/*
-				 * If the word reverse option is specified and
-				 * the current character is not a space, track
-				 * back to the beginning of the word.
-				 */
-				if (reverse == REVERSE_WORD && !iswspace(*p)) {
-					while (cur_line + start_column < p &&
-					    !iswspace(*(p - 1))) {
-						p--;
-						pp--;
-						screen_x -= wcwidth(*p);
-					}
-					move(screen_y, screen_x);
-				}
-				attron(style);
+		/* highlight by the rules */
+		if (nhlrules > 0 && (hls = hlrule_spans(cur, line)) != NULL) {
+			for (i = 0; i < hls->nspans; i++)
+				merge_span(&hls->span[i], attrs, len,
+				    &fill);
+		}
 
-				/* Print character itself.  */
-				cw = wcwidth(*p);
-				addwch(*p++);
-				pp++;
-				screen_x += cw;
+		/* highlight the changes */
+		if (!stale) {
+			for (i = f->first[line]; i < f->first[line + 1]; i++)
+				merge_span(&f->spans[i], attrs, len, &fill);
+		} else if (table_key > 0) {
+			base = (baseline != NULL)? baseline : prev;
+			i = table_row(base, cur, line);
+			nspans = (i == -1 || base->hash[i] != cur->hash[line])?
+			    diff_cells(cur, line, base, i, reverse, spans) : 0;
+			for (i = 0; i < nspans; i++)
+				merge_span(&spans[i], attrs, len, &fill);
+		} else if (baseline != NULL) {
+			nspans = (baseline_changed(baseline, cur, line))?
+			    diff_line(cur->buf[line],
+			    snapshot_line(baseline, line), reverse, spans) : 0;
+			for (i = 0; i < nspans; i++)
+				merge_span(&spans[i], attrs, len, &fill);
+		} else if (!heat_mode) {
+			nspans = diff_line(cur->buf[line],
+			    snapshot_line(prev, line), reverse, spans);
+			for (i = 0; i < nspans; i++)
+				merge_span(&spans[i], attrs, len, &fill);
+		}
 
-				/*
-				 * If the word reverse option is specified, and
-				 * the current character is not a space, print
-				 * the whole word which includes current
-				 * character.
-				 */
-				if (reverse == REVERSE_WORD) {
-					while (*p && !iswspace(*p) &&
-					    screen_x < COLS) {
-						cw = wcwidth(*p);
-						addwch(*p++);
-						pp++;
-						screen_x += cw;
-					}
-				}
-				attrset(A_NORMAL);
-			}
-			break;
+		/* show the number of the changes on the left side */
+		x0 = 0;
+		if (f->churn != NULL) {
+			move(screen_y, 0);
+			attrset(f->churn_attr[line]);
+			printw("%4u", MIN(f->churn[line], 9999));
+			attrset(A_NORMAL);
+			x0 = 5;
 		}
+
+		render_line(screen_y, x0, cur->buf[line], attrs, fill);
 	}
 	move(1, 0);
 	refresh();
@@ -467,26 +1468,34 @@ display(BUFFER * cur, BUFFER * prev, reverse_mode_t reverse)
 }
 
 void
-read_result(BUFFER *buf)
+read_result(struct snapshot *snap)
 {
-	FILE	*fp;
-	int	 i, st, fds[2];
-	pid_t	 pipe_pid, pid;
+	FILE		*fp;
+	int		 st, fds[2];
+	pid_t		 pipe_pid, pid;
+	struct rusage	 ru;
+	struct timespec	 ts0, ts1;
+	struct runstat	*rs = &snap->run;
+	wchar_t		 line[MAXCOLUMN + 1];
 
 	/* Clear buffer */
-	memset(buf, 0, sizeof(*buf));
+	snapshot_clear(snap);
 
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
 	if (pipe(fds) == -1)
 		err(EX_OSERR, "pipe()");
 
-	if ((pipe_pid = vfork()) == -1)
-		err(EX_OSERR, "vfork()");
+	/* use fork(2) to change the settings of the child */
+	if ((pipe_pid = (child_setup)? fork() : vfork()) == -1)
+		err(EX_OSERR, (child_setup)? "fork()" : "vfork()");
 	else if (pipe_pid == 0) {
 		close(fds[0]);
 		if (fds[1] != STDOUT_FILENO) {
 			dup2(fds[1], STDOUT_FILENO);
 			close(fds[1]);
 		}
+		if (child_setup)
+			setup_child();
 		if (xflag)
 			execvp(cmdv[0], cmdv);
 		else
@@ -503,16 +1512,33 @@ read_result(BUFFER *buf)
 	close(fds[1]);
 
 	/* Read command output and convert tab to spaces * */
-	for (i = 0; i < MAXLINE && fgetws((*buf)[i], MAXCOLUMN, fp) != NULL;
-	    i++)
-		untabify((*buf)[i], sizeof((*buf)[i]));
+	while (fgetws(line, MAXCOLUMN, fp) != NULL) {
+		untabify(line, sizeof(line));
+		snapshot_append(snap, line);
+	}
 	fclose(fp);
+	snapshot_digest(snap);
 	do {
-		pid = waitpid(pipe_pid, &st, 0);
+		pid = wait4(pipe_pid, &st, 0, &ru);
 	} while (pid == -1 && errno == EINTR);
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+	/* Remember the resource used by the command */
+	memset(rs, 0, sizeof(*rs));
+	rs->wall = (ts1.tv_sec - ts0.tv_sec) +
+	    (ts1.tv_nsec - ts0.tv_nsec) / 1000000000.0;
+	if (pid != -1) {
+		rs->utime = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+		rs->stime = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+		rs->maxrss = ru.ru_maxrss;
+		rs->nvcsw = ru.ru_nvcsw;
+		rs->nivcsw = ru.ru_nivcsw;
+		rs->status = st;
+	}
 
 	/* Remember update time */
-	time(&lastupdate);
+	time(&snap->time);
+	snap->tick = ++ticks;
 }
 
 /* ch: command character */
@@ -567,7 +1593,10 @@ kbd_command(int ch)
 		 * Pause switch
 		 */
 	case 'p':
-		if ((pause_status = !pause_status) != 0)
+		/* the modes are read by the other threads */
+		__atomic_store_n(&pause_status, !pause_status,
+		    __ATOMIC_RELAXED);
+		if (pause_status)
 			return (RSLT_REDRAW);
 		else
 			return (RSLT_UPDATE);
@@ -578,22 +1607,61 @@ kbd_command(int ch)
 	case 't':
 		if (reverse_mode != REVERSE_NONE) {
 			last_reverse_mode = reverse_mode;
-			reverse_mode = REVERSE_NONE;
+			__atomic_store_n(&reverse_mode, REVERSE_NONE,
+			    __ATOMIC_RELAXED);
 		} else {
-			reverse_mode = last_reverse_mode;
+			__atomic_store_n(&reverse_mode, last_reverse_mode,
+			    __ATOMIC_RELAXED);
 		}
 		break;
 	case 'r':
-		reverse_mode = (reverse_mode == REVERSE_CHAR) ? REVERSE_NONE
-		    : REVERSE_CHAR;
+		__atomic_store_n(&reverse_mode, (reverse_mode == REVERSE_CHAR)
+		    ? REVERSE_NONE : REVERSE_CHAR, __ATOMIC_RELAXED);
 		break;
 	case 'w':
-		reverse_mode = (reverse_mode == REVERSE_WORD) ? REVERSE_NONE
-		    : REVERSE_WORD;
+		__atomic_store_n(&reverse_mode, (reverse_mode == REVERSE_WORD)
+		    ? REVERSE_NONE : REVERSE_WORD, __ATOMIC_RELAXED);
 		break;
 	case 'e':
-		reverse_mode = (reverse_mode == REVERSE_LINE) ? REVERSE_NONE
-		    : REVERSE_LINE;
+		__atomic_store_n(&reverse_mode, (reverse_mode == REVERSE_LINE)
+		    ? REVERSE_NONE : REVERSE_LINE, __ATOMIC_RELAXED);
+		break;
+	case 'c':
+		changes_only = !changes_only;
+		view_stale = 1;
+		start_line = 0;
+		break;
+	case 'n':
+	case 'N':
+	    {
+		int row;
+
+		if (curframe == NULL ||
+		    (row = find_change(curframe, ch == 'n')) == -1)
+			return (RSLT_ERROR);
+		start_line = row;
+		break;
+	    }
+	case 'B':
+		if (baseline != NULL)
+			pin_baseline(NULL);
+		else if (curframe != NULL)
+			pin_baseline(snapshot_ref(curframe->cur));
+		else
+			return (RSLT_ERROR);
+		break;
+	case 'R':
+		show_runstat = !show_runstat;
+		header_lines = (show_runstat)? 3 : 2;
+		break;
+	case 'a':
+		if (prefix > 0 && decimal_point < 0) {
+			__atomic_store_n(&heat_ticks, prefix,
+			    __ATOMIC_RELAXED);
+			__atomic_store_n(&heat_mode, 1, __ATOMIC_RELAXED);
+		} else
+			__atomic_store_n(&heat_mode, !heat_mode,
+			    __ATOMIC_RELAXED);
 		break;
 
 		/*
@@ -606,24 +1674,45 @@ kbd_command(int ch)
 			for (power10 = 1, i = 0; i < decimal_point; i++)
 				power10 *= 10;
 
+			pthread_mutex_lock(&interval_lock);
 			opt_interval.tv_sec = prefix / power10;
 			opt_interval.tv_usec = prefix % power10;
 			for (i = NUM_FRAQ_DIGITS_USEC; i < decimal_point; i++)
 				opt_interval.tv_usec /= 10;
 			for (i = decimal_point; i < NUM_FRAQ_DIGITS_USEC; i++)
 				opt_interval.tv_usec *= 10;
+			adaptive_backoff = 1.0;
+			adaptive_interval = opt_interval;
+			pthread_mutex_unlock(&interval_lock);
 
 			prefix = -1;
 		}
 		return (RSLT_REDRAW);
 
 		/*
-		 * Vertical motion
+		 * Filter lines
 		 */
-	case '\n':
-	case '+':
-	case 'j':
-		start_line = MIN(start_line + 1, MAXLINE - 1);
+	case '/':
+	    {
+		char pattern[MAXCOLUMN + 1];
+
+		if (prompt("/", pattern, sizeof(pattern)) != 0)
+			return (RSLT_REDRAW);
+		if (set_filter(pattern) != 0) {
+			fprintf(stderr, "\007");
+			return (RSLT_REDRAW);
+		}
+		start_line = 0;
+		break;
+	    }
+
+		/*
+		 * Vertical motion
+		 */
+	case '\n':
+	case '+':
+	case 'j':
+		start_line = MIN(start_line + 1, MAX(nview - 1, 0));
 		break;
 	case '-':
 	case 'k':
@@ -632,24 +1721,26 @@ kbd_command(int ch)
 	case 'd':
 	case 'D':
 	case ctrl('d'):
-		start_line = MIN(start_line + ((LINES - 2) / 2), MAXLINE - 1);
+		start_line = MIN(start_line + ((LINES - header_lines) / 2),
+		    MAX(nview - 1, 0));
 		break;
 	case 'u':
 	case 'U':
 	case ctrl('u'):
-		start_line = MAX(start_line - ((LINES - 2) / 2), 0);
+		start_line = MAX(start_line - ((LINES - header_lines) / 2), 0);
 		break;
 	case 'f':
 	case ctrl('f'):
-		start_line = MIN(start_line + (LINES - 2), MAXLINE - 1);
+		start_line = MIN(start_line + (LINES - header_lines),
+		    MAX(nview - 1, 0));
 		break;
 	case 'b':
 	case ctrl('b'):
-		start_line = MAX(start_line - (LINES - 2), 0);
+		start_line = MAX(start_line - (LINES - header_lines), 0);
 		break;
 	case 'g':
-		if (prefix < MAXLINE)
-			start_line = prefix;
+		if (prefix < nview)
+			start_line = MAX(prefix, 0);
 		prefix = -1;
 		break;
 
@@ -707,6 +1798,41 @@ kbd_command(int ch)
 	return (RSLT_REDRAW);
 }
 
+/*
+ * Handle the key and the keys typed ahead, so that the screen is redrawn
+ * once for them.  *rewait is set if the interval may be changed.
+ */
+kbd_result_t
+kbd_commands(int ch, int *rewait)
+{
+	kbd_result_t	 result = RSLT_NOTOUCH;
+
+	*rewait = 0;
+	do {
+		if (ch == 'p' || ch == 'i')
+			*rewait = 1;
+		switch (kbd_command(ch)) {
+		case RSLT_UPDATE:
+			result = RSLT_UPDATE;
+			break;
+		case RSLT_REDRAW:
+			if (result != RSLT_UPDATE)
+				result = RSLT_REDRAW;
+			break;
+		case RSLT_NOTOUCH:
+			break;
+		case RSLT_ERROR:
+			fprintf(stderr, "\007");
+			break;
+		}
+		nodelay(stdscr, TRUE);
+		ch = getch();
+		nodelay(stdscr, FALSE);
+	} while (ch != ERR);
+
+	return (result);
+}
+
 const char *helpmsg[] = {
 	" Scroll:                                         ",
 	"            1-char    half-win  full-win  8-char ",
@@ -716,6 +1842,10 @@ const char *helpmsg[] = {
 	"   LEFT     h         H         <         [      ",
 	"                                                 ",
 	"   g        goto top or prefix number line       ",
+	"   /        filter lines by regular expression   ",
+	"   n, N     goto next or previous changed line   ",
+	"   c        show changed lines only              ",
+	"   B        pin or unpin output as baseline      ",
 	"                                                 ",
 	" Others:                                         ",
 	"   space    update buffer                        ",
@@ -725,8 +1855,11 @@ const char *helpmsg[] = {
 	"   e        reverse entire line                  ",
 	"   w        reverse word                         ",
 	"   t        toggle reverse mode                  ",
+	"   a        fade highlight over prefix number    ",
+	"            of updates and show change counts    ",
 	"   i        set interval for prefix number       ",
 	"   p        pause and restart                    ",
+	"   R        show resource usage of the command   ",
 	"   ?        show this message                    ",
 	"   q        quit                                 ",
 	(char *) 0,
@@ -813,6 +1946,8 @@ on_signal(int signum)
 void
 quit(void)
 {
+	if (server_fd != -1)
+		unlink(server_path);
 	erase();
 	refresh();
 	endwin();
@@ -826,17 +1961,48 @@ usage(void)
 	extern char *__progname;
 
 	fprintf(stderr,
-	    "usage: %s [-rewp] [-i interval] [-s start_line] "
+	    "usage: %s [-rewpP] [-i interval] [-s start_line] "
 		    "[-c start_column]\n"
-	    "       %*s command [arg ...]\n",
-	    __progname, (int) strlen(__progname), " ");
+	    "       %*s [-a ticks] [-f filter] [-H rule_file]\n"
+	    "       %*s [-g] [-m pattern | -M pattern] [-S ticks]\n"
+	    "       %*s [-Fu] [-l logfile] [-L size[:count]] [-A percent]\n"
+	    "       %*s [-n nice] [-I class[:level]] [-C cpulist]\n"
+	    "       %*s [-T resource=limit] [-G cgroup] [-j threads]\n"
+	    "       %*s [-t fps] [-k socket] [-X name:column:pattern ...]\n"
+	    "       %*s [-E [csv:|prom:]file] [-B file] [-d key_column]\n"
+	    "       %*s [-o column[:count] | -O column[:count]]\n"
+	    "       %*s command [arg ...]\n"
+	    "       %s [-t fps] -K socket\n",
+	    __progname, (int) strlen(__progname), " ",
+	    (int) strlen(__progname), " ", (int) strlen(__progname), " ",
+	    (int) strlen(__progname), " ", (int) strlen(__progname), " ",
+	    (int) strlen(__progname), " ", (int) strlen(__progname), " ",
+	    (int) strlen(__progname), " ", (int) strlen(__progname), " ",
+	    __progname);
 }
 
 void
 parse_style(void)
 {
-	int	i;
-	char	*p, *st, *st0, *token;
+	int	 i;
+	char	*p;
+
+	if ((p = getenv("IWATCH_STYLE")) != NULL)
+		style = parse_style_spec(p, style, 1);
+	for (i = 0; i < nhlrules; i++)
+		hlrules[i].attr = parse_style_spec(hlrules[i].spec, A_NORMAL,
+		    0);
+}
+
+/*
+ * Make the attributes from the style specification.  If pair is 0, the
+ * color pair is allocated for each color.
+ */
+int
+parse_style_spec(const char *spec, int attr, int pair)
+{
+	int	 i, n;
+	char	*st, *st0, *token;
 	struct _codestrings {
 		int		 code;
 		int		 no;
@@ -861,32 +2027,2993 @@ parse_style(void)
 		{ A_BOLD,		1, "nobold" },
 	};
 
-	if ((p = getenv("IWATCH_STYLE")) != NULL) {
-		st = st0 = strdup(p);
+	if ((st = st0 = strdup(spec)) == NULL)
+		err(EX_OSERR, "strdup");
 
-		while ((token = strsep(&st, " ,")) != NULL) {
-			if (*token == '\0')
-				continue;
-			for (i = 0; i < nitems(colors); i++) {
-				if (strcasecmp(token, colors[i].string) == 0) {
-					init_pair(1, colors[i].code, -1);
-					style &= ~A_COLOR;
-					style |= COLOR_PAIR(1);
-					goto next_token;
-				}
+	while ((token = strsep(&st, " ,")) != NULL) {
+		if (*token == '\0')
+			continue;
+		for (i = 0; i < nitems(colors); i++) {
+			if (strcasecmp(token, colors[i].string) == 0) {
+				n = (pair == 0)? 2 + colors[i].code : pair;
+				init_pair(n, colors[i].code, -1);
+				attr &= ~A_COLOR;
+				attr |= COLOR_PAIR(n);
+				goto next_token;
 			}
-			for (i = 0; i < nitems(attrs); i++) {
-				if (strcasecmp(token, attrs[i].string) == 0) {
-					if (attrs[i].no)
-						style &= ~attrs[i].code;
-					else
-						style |= attrs[i].code;
-					goto next_token;
-				}
+		}
+		for (i = 0; i < nitems(attrs); i++) {
+			if (strcasecmp(token, attrs[i].string) == 0) {
+				if (attrs[i].no)
+					attr &= ~attrs[i].code;
+				else
+					attr |= attrs[i].code;
+				goto next_token;
 			}
+		}
  next_token:
-			/* empty */;
+		/* empty */;
+	}
+	free(st0);
+
+	return (attr);
+}
+
+/* read a string from the user at the second line of the screen */
+int
+prompt(const char *msg, char *buf, int len)
+{
+	int	 ret;
+
+	move(1, 0);
+	clrtoeol();
+	addstr(msg);
+	refresh();
+	echo();
+	ret = getnstr(buf, len - 1);
+	noecho();
+
+	return ((ret == ERR)? -1 : 0);
+}
+
+/* FNV-1a hash of the line.  0 is reserved for empty cache entries. */
+uint64_t
+line_hash(const wchar_t *line)
+{
+	uint64_t	 h = 0xcbf29ce484222325ULL;
+
+	for (; *line != L'\0'; line++) {
+		h ^= (uint64_t)*line;
+		h *= 0x100000001b3ULL;
+	}
+
+	return ((h == 0)? 1 : h);
+}
+
+/*
+ * Lookup the entry for the hash.  If it doesn't exist, an empty entry is
+ * created and *isnew is set.
+ */
+struct lcache_entry *
+lcache_lookup(struct lcache *lc, uint64_t hash, u_int tick, int *isnew)
+{
+	size_t			 i, j, osize;
+	struct lcache_entry	*ent, *oents;
+
+	*isnew = 0;
+	if (lc->count + 1 > lc->size / 2) {
+		oents = lc->entries;
+		osize = lc->size;
+		/* count the entries used recently */
+		for (i = 0, j = 0; i < osize; i++) {
+			if (oents[i].hash != 0 && oents[i].tick + 1 >= tick)
+				j++;
+		}
+		lc->size = MAX(64, osize);
+		while (j + 1 > lc->size / 4)
+			lc->size *= 2;
+		if ((lc->entries = calloc(lc->size, sizeof(*ent))) == NULL)
+			err(EX_OSERR, "calloc");
+		lc->count = 0;
+		for (i = 0; i < osize; i++) {
+			if (oents[i].hash == 0)
+				continue;
+			if (oents[i].tick + 1 < tick) {
+				if (lc->free_data != NULL)
+					lc->free_data(oents[i].data);
+				continue;
+			}
+			for (j = oents[i].hash & (lc->size - 1);
+			    lc->entries[j].hash != 0; j = (j + 1) & (lc->size - 1))
+				;
+			lc->entries[j] = oents[i];
+			lc->count++;
+		}
+		free(oents);
+	}
+
+	for (i = hash & (lc->size - 1); lc->entries[i].hash != 0;
+	    i = (i + 1) & (lc->size - 1)) {
+		if (lc->entries[i].hash == hash)
+			break;
+	}
+	ent = &lc->entries[i];
+	if (ent->hash == 0) {
+		ent->hash = hash;
+		ent->data = NULL;
+		lc->count++;
+		*isnew = 1;
+	}
+	ent->tick = tick;
+
+	return (ent);
+}
+
+void
+lcache_clear(struct lcache *lc)
+{
+	size_t	 i;
+
+	for (i = 0; i < lc->size; i++) {
+		if (lc->entries[i].hash != 0 && lc->free_data != NULL)
+			lc->free_data(lc->entries[i].data);
+	}
+	free(lc->entries);
+	lc->entries = NULL;
+	lc->size = lc->count = 0;
+}
+
+/* test whether the line matches the regular expression */
+int
+line_match(regex_t *re, const wchar_t *line)
+{
+	char	 mbs[MAXCOLUMN * MB_LEN_MAX + 1];
+
+	if (wcstombs(mbs, line, sizeof(mbs)) == (size_t)-1)
+		return (0);
+
+	return (regexec(re, mbs, 0, NULL, 0) == 0);
+}
+
+/* test whether the line matches using the cache of the results */
+int
+cached_match(struct lcache *lc, regex_t *re, struct snapshot *snap, int line)
+{
+	int			 isnew;
+	struct lcache_entry	*ent;
+
+	ent = lcache_lookup(lc, snap->hash[line], snap->tick, &isnew);
+	if (isnew)
+		ent->data = (void *)(intptr_t)line_match(re, snap->buf[line]);
+
+	return (ent->data != NULL);
+}
+
+/* set the line filter.  the filter is removed if the pattern is empty */
+int
+set_filter(const char *pattern)
+{
+	regex_t	 re;
+
+	if (*pattern != '\0' &&
+	    regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE) != 0)
+		return (-1);
+	if (filter_str != NULL) {
+		regfree(&filter_re);
+		free(filter_str);
+		filter_str = NULL;
+	}
+	lcache_clear(&filter_cache);
+	if (*pattern != '\0') {
+		if ((filter_str = strdup(pattern)) == NULL)
+			err(EX_OSERR, "strdup");
+		filter_re = re;
+	}
+	view_stale = 1;
+
+	return (0);
+}
+
+/*
+ * Update the lines to be displayed.  If changes_only is set, the runs of
+ * the unchanged lines are folded into the negative numbers of the lines.
+ */
+void
+update_view(struct frame *f)
+{
+	int		 i, j, k, n, run;
+	struct snapshot	*snap = f->cur;
+
+	if (snap->nlines > view_size) {
+		view_size = snap->nlines;
+		if ((view = reallocarray(view, view_size, sizeof(int))) == NULL)
+			err(EX_OSERR, "reallocarray");
+	}
+	/* the sorted view has the top lines only */
+	n = (f->top != NULL)? f->ntop : snap->nlines;
+	for (k = 0, j = 0, run = 0, nview = 0; k < n; k++) {
+		i = (f->top != NULL)? f->top[k] : k;
+		/* only the lines not seen in the last ticks are evaluated */
+		if (filter_str != NULL &&
+		    !cached_match(&filter_cache, &filter_re, snap, i))
+			continue;
+		if (changes_only) {
+			if (f->top != NULL)
+				j = lower_bound(f->changed, f->nchanged, i);
+			while (j < f->nchanged && f->changed[j] < i)
+				j++;
+			if (j == f->nchanged || f->changed[j] != i) {
+				run++;
+				continue;
+			}
+			if (run > 0)
+				view[nview++] = -run;
+			run = 0;
+		}
+		view[nview++] = i;
+	}
+	if (run > 0)
+		view[nview++] = -run;
+	view_stale = 0;
+}
+
+/* update the view if the frame or the filter is changed */
+void
+sync_view(struct frame *f)
+{
+	static u_int	 serial = 0;
+
+	if (view_stale || f->serial != serial)
+		update_view(f);
+	serial = f->serial;
+}
+
+/*
+ * Find the row of the next or the previous changed line from start_line.
+ * Returns -1 if there is none.
+ */
+int
+find_change(struct frame *f, int forward)
+{
+	int	 i, row, line;
+
+	sync_view(f);
+	if (nview == 0)
+		return (-1);
+	row = MIN(start_line, nview - 1);
+
+	/* the view has the changed lines only between the folded lines */
+	if (changes_only) {
+		for (i = row + ((forward)? 1 : -1); i >= 0 && i < nview;
+		    i += (forward)? 1 : -1) {
+			if (view[i] >= 0)
+				return (i);
+		}
+		return (-1);
+	}
+
+	/* the sorted view is not in the order of the lines */
+	if (f->top != NULL) {
+		for (i = row + ((forward)? 1 : -1); i >= 0 && i < nview;
+		    i += (forward)? 1 : -1) {
+			line = lower_bound(f->changed, f->nchanged, view[i]);
+			if (line < f->nchanged && f->changed[line] == view[i])
+				return (i);
+		}
+		return (-1);
+	}
+
+	line = view[row];
+	i = lower_bound(f->changed, f->nchanged, line + ((forward)? 1 : 0));
+	for (i = (forward)? i : i - 1; i >= 0 && i < f->nchanged;
+	    i += (forward)? 1 : -1) {
+		/* the line may be filtered out */
+		row = lower_bound(view, nview, f->changed[i]);
+		if (row < nview && view[row] == f->changed[i])
+			return (row);
+	}
+
+	return (-1);
+}
+
+/* index of the first element not less than the value in the sorted array */
+int
+lower_bound(const int *a, int n, int value)
+{
+	int	 lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (a[mid] < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+/* compute the spans of the line which differ from the previous line */
+int
+diff_line(const wchar_t *cur, const wchar_t *prev, reverse_mode_t reverse,
+    struct span *spans)
+{
+	int	 i, start, end, n = 0, prevend = 0;
+
+	switch (reverse) {
+	case REVERSE_NONE:
+		return (0);
+	case REVERSE_LINE:
+		if (wcscmp(cur, prev) == 0)
+			return (0);
+		spans[0].start = 0;
+		spans[0].end = SPAN_EOL;
+		spans[0].attr = style;
+		return (1);
+	default:
+		break;
+	}
+
+	for (i = 0; cur[i] != L'\0' && cur[i] != L'\n'; i++) {
+		if (!prevend && prev[i] == L'\0')
+			prevend = 1;
+		if (!prevend && cur[i] == prev[i])
+			continue;
+		start = i;
+		end = i + 1;
+		/*
+		 * If the word reverse mode is specified and the current
+		 * character is not a space, extend the span to the whole
+		 * word which includes the character.
+		 */
+		if (reverse == REVERSE_WORD && !iswspace(cur[i])) {
+			while (start > 0 && !iswspace(cur[start - 1]))
+				start--;
+			while (cur[end] != L'\0' && !iswspace(cur[end]))
+				end++;
+		}
+		if (n > 0 && spans[n - 1].end >= start)
+			spans[n - 1].end = MAX(spans[n - 1].end, end);
+		else {
+			spans[n].start = start;
+			spans[n].end = end;
+			spans[n].attr = style;
+			n++;
+		}
+	}
+
+	return (n);
+}
+
+/* put the attributes over the base.  the color of the base is replaced */
+int
+merge_attr(int base, int attr)
+{
+	if ((attr & A_COLOR) != 0)
+		base &= ~A_COLOR;
+
+	return (base | attr);
+}
+
+void
+merge_span(const struct span *span, int *attrs, int len, int *fill)
+{
+	int	 i, end;
+
+	end = (span->end == SPAN_EOL)? len : MIN(span->end, len);
+	for (i = span->start; i < end; i++)
+		attrs[i] = merge_attr(attrs[i], span->attr);
+	if (span->end == SPAN_EOL)
+		*fill = merge_attr(*fill, span->attr);
+}
+
+/*
+ * Draw the line from the column x0 with the attributes of each character.
+ * The space on the both sides of the line is filled with the attributes
+ * of fill.
+ */
+void
+render_line(int y, int x0, const wchar_t *line, const int *attrs, int fill)
+{
+	int	 i, j, x, cw, w;
+
+	for (i = 0, cw = 0; cw < start_column && line[i] != L'\0' &&
+	    line[i] != L'\n'; i++)
+		cw += WCWIDTH(line[i]);
+	x = x0 + MAX(cw - start_column, 0);
+
+	move(y, x0);
+	if (fill != A_NORMAL) {
+		attrset(fill);
+		for (j = x0; j < x; j++)
+			addch(' ');
+	}
+	move(y, x);
+	while (line[i] != L'\0' && line[i] != L'\n') {
+		if (x + WCWIDTH(line[i]) >= COLS)
+			break;
+		/* print the characters which have the same attributes */
+		for (j = i, w = 0; line[j] != L'\0' && line[j] != L'\n' &&
+		    attrs[j] == attrs[i]; j++) {
+			cw = WCWIDTH(line[j]);
+			if (x + w + cw >= COLS)
+				break;
+			w += cw;
+		}
+		attrset(attrs[i]);
+		addnwstr(line + i, j - i);
+		x += w;
+		i = j;
+	}
+	if (fill != A_NORMAL) {
+		attrset(fill);
+		for (; x < COLS; x++)
+			addch(' ');
+	}
+	attrset(A_NORMAL);
+}
+
+/*
+ * Add the highlight rule in the form of "style pattern".  Empty lines and
+ * the lines which start with '#' are ignored.
+ */
+int
+add_hlrule(const char *rule)
+{
+	size_t		 speclen, len;
+	char		*s;
+	const char	*pattern;
+	regex_t		 re;
+	struct hlrule	*r;
+
+	rule += strspn(rule, " \t");
+	if (*rule == '\0' || *rule == '#')
+		return (0);
+	speclen = strcspn(rule, " \t");
+	pattern = rule + speclen + strspn(rule + speclen, " \t");
+	if (*pattern == '\0')
+		return (-1);
+	if (regcomp(&re, pattern, REG_EXTENDED | REG_NEWLINE) != 0)
+		return (-1);
+
+	if ((r = reallocarray(hlrules, nhlrules + 1, sizeof(*r))) == NULL)
+		err(EX_OSERR, "reallocarray");
+	hlrules = r;
+	r = &hlrules[nhlrules++];
+	if ((r->spec = strndup(rule, speclen)) == NULL)
+		err(EX_OSERR, "strndup");
+	r->attr = A_NORMAL;
+	r->subexp = hl_nsub + 1;
+	hl_nsub += re.re_nsub + 1;
+	regfree(&re);
+
+	/* combine the patterns like "(rule1)|(rule2)|..." */
+	len = (hl_pattern == NULL)? 0 : strlen(hl_pattern);
+	if ((s = realloc(hl_pattern, len + strlen(pattern) + 4)) == NULL)
+		err(EX_OSERR, "realloc");
+	hl_pattern = s;
+	snprintf(hl_pattern + len, strlen(pattern) + 4, "%s(%s)",
+	    (len == 0)? "" : "|", pattern);
+
+	return (0);
+}
+
+/* load the highlight rules separated by newlines */
+void
+load_hlrules(const char *rules, const char *origin)
+{
+	int	 lineno;
+	char	*s, *s0, *rule;
+
+	if ((s = s0 = strdup(rules)) == NULL)
+		err(EX_OSERR, "strdup");
+	for (lineno = 1; (rule = strsep(&s, "\n")) != NULL; lineno++) {
+		if (add_hlrule(rule) != 0)
+			errx(EX_USAGE, "%s:%d: invalid highlight rule: %s",
+			    origin, lineno, rule);
+	}
+	free(s0);
+}
+
+void
+load_hlrule_file(const char *path)
+{
+	int	 lineno;
+	char	*line = NULL;
+	size_t	 linesiz = 0;
+	ssize_t	 len;
+	FILE	*fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(EX_NOINPUT, "%s", path);
+	for (lineno = 1; (len = getline(&line, &linesiz, fp)) != -1;
+	    lineno++) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (add_hlrule(line) != 0)
+			errx(EX_DATAERR, "%s:%d: invalid highlight rule: %s",
+			    path, lineno, line);
+	}
+	if (ferror(fp))
+		err(EX_IOERR, "%s", path);
+	free(line);
+	fclose(fp);
+}
+
+/* compile the rules into one regular expression */
+void
+compile_hlrules(void)
+{
+	if (nhlrules == 0)
+		return;
+	if (regcomp(&hl_re, hl_pattern, REG_EXTENDED | REG_NEWLINE) != 0)
+		errx(EX_USAGE, "invalid highlight rules: %s", hl_pattern);
+	if ((hl_match = calloc(hl_nsub + 1, sizeof(regmatch_t))) == NULL)
+		err(EX_OSERR, "calloc");
+}
+
+/* find the spans of the line which match the highlight rules */
+struct spans *
+hlrule_match(const wchar_t *line)
+{
+	int		 i, r, n = 0, eflags = 0;
+	char		 mbs[MAXCOLUMN * MB_LEN_MAX + 1];
+	short		 idx[MAXCOLUMN * MB_LEN_MAX + 1];
+	size_t		 off, len, k, so, eo;
+	mbstate_t	 ps;
+	struct span	 spans[MAXCOLUMN + 1];
+	struct spans	*result;
+
+	/* convert to multibyte remembering the index of each character */
+	memset(&ps, 0, sizeof(ps));
+	for (i = 0, off = 0; line[i] != L'\0' && line[i] != L'\n'; i++) {
+		if ((len = wcrtomb(mbs + off, line[i], &ps)) == (size_t)-1) {
+			memset(&ps, 0, sizeof(ps));
+			mbs[off] = '?';
+			len = 1;
+		}
+		for (k = 0; k < len; k++)
+			idx[off + k] = i;
+		off += len;
+	}
+	mbs[off] = '\0';
+	idx[off] = i;
+	len = off;
+
+	for (off = 0; off <= len && n < nitems(spans); eflags = REG_NOTBOL) {
+		if (regexec(&hl_re, mbs + off, hl_nsub + 1, hl_match,
+		    eflags) != 0)
+			break;
+		so = off + hl_match[0].rm_so;
+		eo = off + hl_match[0].rm_eo;
+		for (r = 0; r < nhlrules; r++) {
+			if (hl_match[hlrules[r].subexp].rm_so != -1)
+				break;
+		}
+		if (eo > so && r < nhlrules) {
+			spans[n].start = idx[so];
+			spans[n].end = idx[eo];
+			spans[n].attr = hlrules[r].attr;
+			n++;
+		}
+		/* skip the empty match not to loop forever */
+		for (off = MAX(eo, so + 1);
+		    off < len && idx[off] == idx[off - 1]; off++)
+			;
+	}
+	if (n == 0)
+		return (NULL);
+
+	if ((result = malloc(offsetof(struct spans, span[n]))) == NULL)
+		err(EX_OSERR, "malloc");
+	result->nspans = n;
+	memcpy(result->span, spans, n * sizeof(struct span));
+
+	return (result);
+}
+
+/* return the spans which match the highlight rules or NULL */
+struct spans *
+hlrule_spans(struct snapshot *snap, int line)
+{
+	int			 isnew;
+	struct lcache_entry	*ent;
+
+	ent = lcache_lookup(&hl_cache, snap->hash[line], snap->tick, &isnew);
+	if (isnew)
+		ent->data = hlrule_match(snap->buf[line]);
+
+	return (ent->data);
+}
+
+/* update the history of the changes from the previous snapshot */
+void
+update_lineage(struct snapshot *cur, struct snapshot *prev)
+{
+	int		 i, hticks = 0;
+	struct lineage	*la;
+
+	if (__atomic_load_n(&heat_mode, __ATOMIC_RELAXED))
+		hticks = __atomic_load_n(&heat_ticks, __ATOMIC_RELAXED);
+	else if (lineage_runs) {
+		/* the runs are needed only for the heat mode */
+		for (i = 0; i < nlineage; i++) {
+			free(lineage[i].runs);
+			lineage[i].runs = NULL;
+			lineage[i].nruns = 0;
+		}
+		lineage_runs = 0;
+	}
+
+	for (i = 0; i < MAX(cur->nlines, prev->nlines); i++) {
+		if (i < cur->nlines && i < prev->nlines &&
+		    cur->hash[i] == prev->hash[i])
+			continue;
+		la = &lineage[i];
+		la->changed = cur->tick;
+		la->churn++;
+		if (hticks > 0)
+			update_runs(la, snapshot_line(cur, i),
+			    snapshot_line(prev, i), cur->tick, hticks);
+	}
+}
+
+/*
+ * Record the characters of the line c changed from p at the tick.  The
+ * runs older than hticks are dropped, and the oldest ones when the line
+ * has more than HEAT_RUNS.
+ */
+void
+update_runs(struct lineage *la, const wchar_t *c, const wchar_t *p,
+    u_int tick, int hticks)
+{
+	int		 i, j, k, n = 0, nold = 0, nall, pos, prevend;
+	struct agerun	 new[HEAT_RUNS], old[HEAT_RUNS * 2];
+	struct agerun	 all[HEAT_RUNS * 3], *r;
+
+	for (j = 0, prevend = 0; c[j] != L'\0' && j < MAXCOLUMN; j++) {
+		if (!prevend && p[j] == L'\0')
+			prevend = 1;
+		if (!prevend && c[j] == p[j])
+			continue;
+		if (n > 0 && new[n - 1].end == j)
+			new[n - 1].end++;
+		else if (n == HEAT_RUNS)
+			new[n - 1].end = j + 1;	/* join up the gap */
+		else {
+			new[n].start = j;
+			new[n].end = j + 1;
+			new[n].tick = tick;
+			n++;
+		}
+	}
+	if (n == 0)
+		return;
+
+	/* the rest of the live runs not overwritten */
+	for (i = 0; i < la->nruns; i++) {
+		r = &la->runs[i];
+		if (tick - r->tick >= hticks)
+			continue;
+		pos = r->start;
+		for (k = 0; k < n && new[k].start < r->end; k++) {
+			if (new[k].end <= pos)
+				continue;
+			if (new[k].start > pos) {
+				old[nold] = *r;
+				old[nold].start = pos;
+				old[nold++].end = new[k].start;
+			}
+			pos = MAX(pos, new[k].end);
+		}
+		if (pos < r->end) {
+			old[nold] = *r;
+			old[nold++].start = pos;
 		}
-		free(st0);
 	}
+
+	for (i = j = nall = 0; i < nold || j < n; nall++)
+		all[nall] = (j == n || (i < nold &&
+		    old[i].start < new[j].start))? old[i++] : new[j++];
+	while (nall > HEAT_RUNS) {
+		for (i = 1, k = 0; i < nall; i++)
+			if (tick - all[i].tick > tick - all[k].tick)
+				k = i;
+		memmove(&all[k], &all[k + 1], (nall - k - 1) * sizeof(*all));
+		nall--;
+	}
+
+	if (la->runs == NULL &&
+	    (la->runs = calloc(HEAT_RUNS, sizeof(*la->runs))) == NULL)
+		err(EX_OSERR, "calloc");
+	memcpy(la->runs, all, nall * sizeof(*all));
+	la->nruns = nall;
+	lineage_runs = 1;
+}
+
+/* attributes for the change which is made before the age ticks */
+int
+heat_attr(u_int age, int hticks)
+{
+	int	 attrs[] = {
+		style,
+		(style & A_COLOR) | A_BOLD | A_UNDERLINE,
+		(style & A_COLOR) | A_UNDERLINE,
+		(style & A_COLOR) | A_DIM | A_UNDERLINE
+	};
+
+	return (attrs[MIN(age * nitems(attrs) / hticks,
+	    nitems(attrs) - 1)]);
+}
+
+/* compute the spans of the line changed in the last hticks at the tick */
+int
+heat_line(const wchar_t *cur, int line, reverse_mode_t reverse, u_int tick,
+    int hticks, struct span *spans)
+{
+	int		 i, n = 0, attr, len;
+	struct lineage	*la = &lineage[line];
+	struct agerun	*r;
+
+	if (reverse == REVERSE_NONE || la->changed == 0 ||
+	    tick - la->changed >= hticks)
+		return (0);
+	if (reverse == REVERSE_LINE) {
+		spans[0].start = 0;
+		spans[0].end = SPAN_EOL;
+		spans[0].attr = heat_attr(tick - la->changed, hticks);
+		return (1);
+	}
+
+	len = wcscspn(cur, L"\n");
+	for (i = 0; i < la->nruns; i++) {
+		r = &la->runs[i];
+		if (r->start >= len || tick - r->tick >= hticks)
+			continue;
+		attr = heat_attr(tick - r->tick, hticks);
+		if (n > 0 && spans[n - 1].end == r->start &&
+		    spans[n - 1].attr == attr)
+			spans[n - 1].end = MIN(r->end, len);
+		else {
+			spans[n].start = r->start;
+			spans[n].end = MIN(r->end, len);
+			spans[n].attr = attr;
+			n++;
+		}
+	}
+
+	return (n);
+}
+
+void
+wbuf_reserve(struct wbuf *wb, size_t len)
+{
+	size_t	 size;
+	char	*buf;
+
+	if (wb->len + len <= wb->size)
+		return;
+	for (size = MAX(wb->size, 4096); size < wb->len + len; size *= 2)
+		;
+	if ((buf = realloc(wb->buf, size)) == NULL)
+		err(EX_OSERR, "realloc");
+	wb->buf = buf;
+	wb->size = size;
+}
+
+void
+wbuf_printf(struct wbuf *wb, const char *fmt, ...)
+{
+	int	 len;
+	va_list	 ap;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	wbuf_reserve(wb, len + 1);
+	va_start(ap, fmt);
+	vsnprintf(wb->buf + wb->len, len + 1, fmt, ap);
+	va_end(ap);
+	wb->len += len;
+}
+
+/* add the wide character string converted to the multibyte string */
+void
+wbuf_addwcs(struct wbuf *wb, const wchar_t *wcs)
+{
+	size_t		 len;
+	mbstate_t	 ps;
+
+	memset(&ps, 0, sizeof(ps));
+	wbuf_reserve(wb, wcslen(wcs) * MB_CUR_MAX);
+	for (; *wcs != L'\0'; wcs++) {
+		if ((len = wcrtomb(wb->buf + wb->len, *wcs, &ps)) ==
+		    (size_t)-1) {
+			memset(&ps, 0, sizeof(ps));
+			wb->buf[wb->len] = '?';
+			len = 1;
+		}
+		wb->len += len;
+	}
+}
+
+/* write the all data in the buffer to the file descriptor */
+int
+wbuf_flush(struct wbuf *wb, int fd)
+{
+	size_t	 off;
+	ssize_t	 n;
+
+	for (off = 0; off < wb->len; off += n) {
+		if ((n = write(fd, wb->buf + off, wb->len - off)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			wb->len = 0;
+			return (-1);
+		}
+	}
+	wb->len = 0;
+
+	return (0);
+}
+
+/* parse the size which may have the suffix 'k', 'M' or 'G' */
+long long
+parse_size(const char *str)
+{
+	long long	 size, mult = 1;
+	char		*e;
+
+	errno = 0;
+	size = strtoll(str, &e, 10);
+	if (e == str || errno != 0 || size < 0)
+		return (-1);
+	switch (*e) {
+	case 'k': case 'K':
+		mult = 1024LL;
+		e++;
+		break;
+	case 'm': case 'M':
+		mult = 1024LL * 1024;
+		e++;
+		break;
+	case 'g': case 'G':
+		mult = 1024LL * 1024 * 1024;
+		e++;
+		break;
+	}
+	if (*e != '\0' || size > LLONG_MAX / mult)
+		return (-1);
+
+	return (size * mult);
+}
+
+void
+difflog_open(void)
+{
+	struct stat	 st;
+
+	if ((difflog_fd = open(difflog_path,
+	    O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		err(EX_CANTCREAT, "%s", difflog_path);
+	if (fstat(difflog_fd, &st) == -1)
+		err(EX_IOERR, "%s", difflog_path);
+	difflog_size = st.st_size;
+}
+
+/*
+ * Append the changed lines to the log in the unified diff format.  The
+ * first output is logged as the lines added to the empty.
+ */
+void
+difflog_write(struct snapshot *cur, struct snapshot *prev)
+{
+	size_t		 len;
+	char		 tbuf[64];
+	struct wbuf	*wb = &difflog_buf;
+
+	if (cur != prev && cur->digest == prev->digest)
+		return;
+
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %z",
+	    localtime(&prev->time));
+	wbuf_printf(wb, "--- %s\t%s\n", cmdstr, tbuf);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S %z",
+	    localtime(&cur->time));
+	wbuf_printf(wb, "+++ %s\t%s\n", cmdstr, tbuf);
+	diff_hunks(wb, cur, prev);
+
+	len = wb->len;
+	if (wbuf_flush(wb, difflog_fd) == -1)
+		return;
+	difflog_size += len;
+	if (difflog_sync)
+		fdatasync(difflog_fd);
+	if (difflog_maxsize > 0 && difflog_size >= difflog_maxsize)
+		difflog_rotate();
+}
+
+/*
+ * Add the hunks of the changed lines.  The lines are compared by the
+ * index.  Returns the number of the hunks.
+ */
+int
+diff_hunks(struct wbuf *wb, struct snapshot *cur, struct snapshot *prev)
+{
+	int		 i, j, k, nlines, nprev, ndel, nadd, nhunks = 0;
+
+	nprev = (cur == prev)? 0 : prev->nlines;
+	nlines = MAX(nprev, cur->nlines);
+	for (i = 0; i < nlines; i = j) {
+		/* find the run of the changed lines */
+		for (j = i; j < nlines; j++) {
+			if (j < nprev && j < cur->nlines &&
+			    prev->hash[j] == cur->hash[j])
+				break;
+		}
+		if (j == i) {
+			j++;
+			continue;
+		}
+		ndel = MAX(MIN(j, nprev) - i, 0);
+		nadd = MAX(MIN(j, cur->nlines) - i, 0);
+		wbuf_printf(wb, "@@ -%d,%d +%d,%d @@\n",
+		    (ndel == 0)? i : i + 1, ndel,
+		    (nadd == 0)? i : i + 1, nadd);
+		for (k = i; k < i + ndel; k++)
+			difflog_line(wb, '-', prev->buf[k]);
+		for (k = i; k < i + nadd; k++)
+			difflog_line(wb, '+', cur->buf[k]);
+		nhunks++;
+	}
+
+	return (nhunks);
+}
+
+/* add the line with the sign.  the line without the newline is marked */
+void
+difflog_line(struct wbuf *wb, char sign, const wchar_t *line)
+{
+	size_t	 len = wcslen(line);
+
+	wbuf_printf(wb, "%c", sign);
+	wbuf_addwcs(wb, line);
+	if (len == 0 || line[len - 1] != L'\n')
+		wbuf_printf(wb, "\n\\ No newline at end of file\n");
+}
+
+/* rename the log to "log.0", "log.0" to "log.1" and so on */
+void
+difflog_rotate(void)
+{
+	int	 i, fd;
+	char	 opath[PATH_MAX], npath[PATH_MAX];
+
+	for (i = difflog_count - 1; i >= 0; i--) {
+		if (i == 0)
+			snprintf(opath, sizeof(opath), "%s", difflog_path);
+		else
+			snprintf(opath, sizeof(opath), "%s.%d", difflog_path,
+			    i - 1);
+		snprintf(npath, sizeof(npath), "%s.%d", difflog_path, i);
+		if (rename(opath, npath) == -1 && errno != ENOENT)
+			goto fail;
+	}
+	if ((fd = open(difflog_path,
+	    O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		goto fail;
+	close(difflog_fd);
+	difflog_fd = fd;
+	difflog_size = 0;
+	return;
+
+fail:
+	/*
+	 * Keep writing to the current file without the rotation.  The worker
+	 * doesn't exit with the screen, the error is shown instead.
+	 */
+	__atomic_store_n(&difflog_errno, errno, __ATOMIC_RELAXED);
+	difflog_maxsize = 0;
+}
+
+/*
+ * Stretch the interval to keep the cpu time of the command under
+ * adaptive_pct percent of the period, and back off while the output is not
+ * changed.
+ */
+void
+adapt_interval(const struct runstat *rs, int changed)
+{
+	double	 intvl, cpu, wall;
+
+	pthread_mutex_lock(&interval_lock);
+	if (changed)
+		adaptive_backoff = 1.0;
+	else
+		adaptive_backoff = MIN(adaptive_backoff * ADAPTIVE_BACKOFF,
+		    ADAPTIVE_MAX_BACKOFF);
+
+	cpu = rs->utime + rs->stime;
+	wall = rs->wall;
+	intvl = opt_interval.tv_sec + opt_interval.tv_usec / 1000000.0;
+	intvl = MAX(intvl, cpu * 100 / adaptive_pct - wall) * adaptive_backoff;
+
+	/* round to milliseconds */
+	adaptive_interval.tv_sec = (time_t)intvl;
+	adaptive_interval.tv_usec = (suseconds_t)
+	    ((intvl - (time_t)intvl) * 1000) * 1000;
+	if (timercmp(&adaptive_interval, &opt_interval, <))
+		adaptive_interval = opt_interval;
+	pthread_mutex_unlock(&interval_lock);
+}
+
+/*
+ * Whether the screen can be painted now within the frame rate.  If not,
+ * the time to wait is stored to tv.
+ */
+int
+paint_due(double *next, struct timeval *tv)
+{
+	double		 now, wait;
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	if (now < *next) {
+		if (tv != NULL) {
+			wait = *next - now;
+			tv->tv_sec = (time_t)wait;
+			tv->tv_usec = (suseconds_t)
+			    ((wait - (time_t)wait) * 1000000);
+		}
+		return (0);
+	}
+	*next = now + 1.0 / frame_rate;
+
+	return (1);
+}
+
+/* the interval to wait for the next run */
+void
+get_interval(struct timeval *tv)
+{
+	pthread_mutex_lock(&interval_lock);
+	*tv = (adaptive_pct > 0)? adaptive_interval : opt_interval;
+	pthread_mutex_unlock(&interval_lock);
+}
+
+void
+printw_interval(const struct timeval *tv)
+{
+	int	 i, val;
+
+	if (tv->tv_usec == 0)
+		printw("%d", (int)tv->tv_sec);
+	else {
+		for (i = NUM_FRAQ_DIGITS_USEC, val = tv->tv_usec;
+		    val % 10 == 0; val /= 10)
+			i--;
+		printw("%d.%0*d", (int)tv->tv_sec, i, val);
+	}
+}
+
+void
+record_runstat(const struct runstat *rs)
+{
+	runstats[nruns++ % NRUNSTATS] = *rs;
+}
+
+/* average of the resource usage of the last runs */
+void
+runstat_average(struct runstat *avg)
+{
+	u_int	 i, n;
+
+	memset(avg, 0, sizeof(*avg));
+	n = MIN(nruns, NRUNSTATS);
+	for (i = 0; i < n; i++) {
+		avg->wall += runstats[i].wall;
+		avg->utime += runstats[i].utime;
+		avg->stime += runstats[i].stime;
+		avg->maxrss += runstats[i].maxrss;
+		avg->nvcsw += runstats[i].nvcsw;
+		avg->nivcsw += runstats[i].nivcsw;
+	}
+	if (n == 0)
+		return;
+	avg->wall /= n;
+	avg->utime /= n;
+	avg->stime /= n;
+	avg->maxrss /= n;
+	avg->nvcsw /= n;
+	avg->nivcsw /= n;
+}
+
+int
+format_runstat(char *buf, size_t bufsiz, const char *label,
+    const struct runstat *rs)
+{
+	return (snprintf(buf, bufsiz,
+	    "%s: %.3fs real %.3fs user %.3fs sys %ldK rss %ld/%ld csw",
+	    label, rs->wall, rs->utime, rs->stime, rs->maxrss, rs->nvcsw,
+	    rs->nivcsw));
+}
+
+/*
+ * Parse the list of the cpus like "0-3,8".  Returns the number of the
+ * selected cpus or -1 if the list is invalid.
+ */
+int
+parse_cpulist(const char *str, u_char *cpus, int ncpus)
+{
+	int		 n = 0;
+	long		 i, first, last;
+	char		*e;
+
+	memset(cpus, 0, ncpus);
+	for (;;) {
+		first = last = strtol(str, &e, 10);
+		if (e == str || first < 0)
+			return (-1);
+		if (*e == '-') {
+			str = e + 1;
+			last = strtol(str, &e, 10);
+			if (e == str || last < first)
+				return (-1);
+		}
+		if (last >= ncpus)
+			return (-1);
+		for (i = first; i <= last; i++) {
+			if (!cpus[i])
+				n++;
+			cpus[i] = 1;
+		}
+		if (*e == '\0')
+			break;
+		if (*e != ',')
+			return (-1);
+		str = e + 1;
+	}
+
+	return (n);
+}
+
+/* parse the I/O scheduling class like "idle" or "best-effort:7" */
+void
+parse_ionice(const char *str)
+{
+	int		 i;
+	size_t		 len;
+	const char	*e;
+	struct {
+		const char	*name;
+		int		 class;
+	} classes[] = {
+		{ "realtime",		1 },
+		{ "best-effort",	2 },
+		{ "idle",		3 },
+	};
+
+#if !defined(__linux__) || !defined(SYS_ioprio_set)
+	errx(EX_USAGE, "-I is not supported on this system");
+#endif
+	len = strcspn(str, ":");
+	for (i = 0; i < nitems(classes); i++) {
+		if (strlen(classes[i].name) == len &&
+		    strncmp(str, classes[i].name, len) == 0)
+			break;
+	}
+	if (i >= nitems(classes))
+		errx(EX_USAGE, "invalid I/O scheduling class: %s", str);
+	child_ioclass = classes[i].class;
+	if (str[len] == ':') {
+		e = str + len + 1;
+		if (strlen(e) != 1 || *e < '0' || *e > '7')
+			errx(EX_USAGE, "invalid I/O priority: %s", e);
+		child_iolevel = *e - '0';
+	}
+}
+
+/* parse the resource limit like "cpu=10" or "mem=512M" */
+void
+parse_rlimit(const char *str)
+{
+	int		 i;
+	size_t		 len;
+	long long	 value;
+	char		*e;
+
+	len = strcspn(str, "=");
+	for (i = 0; i < nitems(child_rlimits); i++) {
+		if (strlen(child_rlimits[i].name) == len &&
+		    strncmp(str, child_rlimits[i].name, len) == 0)
+			break;
+	}
+	if (i >= nitems(child_rlimits) || str[len] != '=')
+		errx(EX_USAGE, "invalid resource limit: %s", str);
+	if (child_rlimits[i].is_size)
+		value = parse_size(str + len + 1);
+	else {
+		value = strtoll(str + len + 1, &e, 10);
+		if (str[len + 1] == '\0' || *e != '\0')
+			value = -1;
+	}
+	if (value <= 0)
+		errx(EX_USAGE, "invalid resource limit: %s", str);
+	child_rlimits[i].value = value;
+	child_rlimits[i].set = 1;
+}
+
+/*
+ * Make the strings used by setup_child() in advance.  The child of the
+ * threads must not call the functions which may take the locks.
+ */
+void
+prepare_child(void)
+{
+	extern char	*__progname;
+
+	if (child_cgroup != NULL && snprintf(child_procs, sizeof(child_procs),
+	    "%s/cgroup.procs", child_cgroup) >= (int)sizeof(child_procs))
+		errx(EX_USAGE, "%s: path too long", child_cgroup);
+	snprintf(child_errmsg, sizeof(child_errmsg), "%s: setup(%.*s) failed: ",
+	    __progname, MAX_COMMAND_LENGTH, cmdstr);
+}
+
+/*
+ * Apply the settings to the child before executing the command.  Only the
+ * async-signal-safe functions are used, since it is forked from threads.
+ */
+void
+setup_child(void)
+{
+	int		 i, fd;
+	const char	*what;
+	struct rlimit	 rl;
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t	 cpuset;
+#endif
+
+	if (child_cgroup != NULL) {
+		what = "cgroup\n";
+		if ((fd = open(child_procs, O_WRONLY)) == -1)
+			goto fail;
+		/* "0" is the process writing it */
+		if (write(fd, "0\n", 2) != 2)
+			goto fail;
+		close(fd);
+	}
+	if (child_nice != 0) {
+		what = "nice\n";
+		errno = 0;
+		if (nice(child_nice) == -1 && errno != 0)
+			goto fail;
+	}
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	/* IOPRIO_WHO_PROCESS and IOPRIO_PRIO_VALUE() */
+	what = "ionice\n";
+	if (child_ioclass != 0 && syscall(SYS_ioprio_set, 1, 0,
+	    (child_ioclass << 13) | child_iolevel) == -1)
+		goto fail;
+#endif
+#ifdef HAVE_SCHED_SETAFFINITY
+	if (child_ncpus > 0) {
+		what = "cpus\n";
+		CPU_ZERO(&cpuset);
+		for (i = 0; i < MAXCPUS && i < CPU_SETSIZE; i++) {
+			if (child_cpus[i])
+				CPU_SET(i, &cpuset);
+		}
+		if (sched_setaffinity(0, sizeof(cpuset), &cpuset) == -1)
+			goto fail;
+	}
+#endif
+	for (i = 0; i < nitems(child_rlimits); i++) {
+		if (!child_rlimits[i].set)
+			continue;
+		what = "rlimit\n";
+		rl.rlim_cur = rl.rlim_max = child_rlimits[i].value;
+		if (setrlimit(child_rlimits[i].resource, &rl) == -1)
+			goto fail;
+	}
+
+	return;
+ fail:
+	/* use write(2) + _exit(2) not to take the locks */
+	write(STDERR_FILENO, child_errmsg, strlen(child_errmsg));
+	write(STDERR_FILENO, what, strlen(what));
+	_exit(EX_OSERR);
+}
+
+struct snapshot *
+snapshot_new(void)
+{
+	struct snapshot	*snap;
+
+	if ((snap = calloc(1, sizeof(*snap))) == NULL)
+		err(EX_OSERR, "calloc");
+	snap->refcnt = 1;
+
+	return (snap);
+}
+
+/* free the lines to read the output again */
+void
+snapshot_clear(struct snapshot *snap)
+{
+	int	 i;
+
+	for (i = 0; i < snap->nlines; i++)
+		free(snap->buf[i]);
+	snap->nlines = 0;
+}
+
+/* the line of the snapshot, or the empty line after the last line */
+const wchar_t *
+snapshot_line(struct snapshot *snap, int line)
+{
+	return ((line < snap->nlines)? snap->buf[line] : L"");
+}
+
+struct snapshot *
+snapshot_ref(struct snapshot *snap)
+{
+	__atomic_add_fetch(&snap->refcnt, 1, __ATOMIC_RELAXED);
+
+	return (snap);
+}
+
+void
+snapshot_release(struct snapshot *snap)
+{
+	if (snap == NULL ||
+	    __atomic_sub_fetch(&snap->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	snapshot_clear(snap);
+	free(snap->buf);
+	free(snap->hash);
+	free(snap->index);
+	free(snap->cells);
+	free(snap->keys);
+	free(snap->kindex);
+	free(snap);
+}
+
+/*
+ * Account the snapshot as the latest output: the history of the changes,
+ * the log and the interval are updated.  The reference is taken over.
+ */
+void
+process_snapshot(struct snapshot *snap)
+{
+	record_runstat(&snap->run);
+	if (table_key > 0)
+		table_split(snap);
+	snapshot_release(proc_prev);
+	proc_prev = (proc_cur != NULL)? proc_cur : snapshot_ref(snap);
+	proc_cur = snap;
+	lineage_reserve(MAX(proc_cur->nlines, proc_prev->nlines));
+
+	if (proc_cur != proc_prev)
+		update_lineage(proc_cur, proc_prev);
+	if (difflog_fd != -1)
+		difflog_write(proc_cur, proc_prev);
+	if (export_path != NULL)
+		export_write(proc_cur, proc_prev);
+	if (adaptive_pct > 0)
+		adapt_interval(&snap->run, proc_cur == proc_prev ||
+		    proc_cur->digest != proc_prev->digest);
+	if (server_fd != -1)
+		server_publish(proc_cur);
+}
+
+/*
+ * Compute the highlight of the changes for the current modes.  The lines
+ * of the large outputs are compared by the threads in the chunks.
+ */
+struct frame *
+make_frame(struct snapshot *cur, struct snapshot *prev)
+{
+	int		 i, j, k, njobs = 1, chunk;
+	struct frame	*f;
+	struct diffjob	*jobs, *job;
+	static u_int	 serial = 0;
+
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+		err(EX_OSERR, "calloc");
+	f->cur = snapshot_ref(cur);
+	f->prev = snapshot_ref(prev);
+	pthread_mutex_lock(&baseline_lock);
+	if (baseline != NULL)
+		f->base = snapshot_ref(baseline);
+	pthread_mutex_unlock(&baseline_lock);
+	f->reverse = __atomic_load_n(&reverse_mode, __ATOMIC_RELAXED);
+	f->heat = __atomic_load_n(&heat_mode, __ATOMIC_RELAXED);
+	f->heat_ticks = __atomic_load_n(&heat_ticks, __ATOMIC_RELAXED);
+	f->last = cur->run;
+	f->serial = ++serial;
+	runstat_average(&f->avg);
+	if ((f->first = calloc(cur->nlines + 1, sizeof(int))) == NULL)
+		err(EX_OSERR, "calloc");
+	if (f->heat &&
+	    ((f->churn = calloc(cur->nlines + 1, sizeof(u_int))) == NULL ||
+	    (f->churn_attr = calloc(cur->nlines + 1, sizeof(int))) == NULL))
+		err(EX_OSERR, "calloc");
+
+	if (diff_threads > 1 && cur->nlines >= PARALLEL_LINES)
+		njobs = (cur->nlines + DIFF_CHUNK - 1) / DIFF_CHUNK;
+	chunk = (njobs == 1)? cur->nlines : DIFF_CHUNK;
+	if ((jobs = calloc(njobs, sizeof(*jobs))) == NULL)
+		err(EX_OSERR, "calloc");
+	for (i = 0; i < njobs; i++) {
+		jobs[i].f = f;
+		jobs[i].reverse = (cur == prev && f->base == NULL)?
+		    REVERSE_NONE : f->reverse;
+		jobs[i].start = i * chunk;
+		jobs[i].end = MIN((i + 1) * chunk, cur->nlines);
+	}
+	if (njobs == 1)
+		diff_chunk(&jobs[0]);
+	else
+		pool_run(jobs, njobs);
+
+	/* merge the spans and the changed lines of the chunks */
+	if (njobs == 1) {
+		f->spans = jobs[0].spans;
+		f->nspans = jobs[0].nspans;
+		f->changed = jobs[0].changed;
+		f->nchanged = jobs[0].nchanged;
+	} else {
+		for (i = 0, j = 0, k = 0; i < njobs; i++) {
+			j += jobs[i].nspans;
+			k += jobs[i].nchanged;
+		}
+		if ((f->spans = reallocarray(NULL, MAX(j, 1),
+		    sizeof(struct span))) == NULL ||
+		    (f->changed = reallocarray(NULL, MAX(k, 1),
+		    sizeof(int))) == NULL)
+			err(EX_OSERR, "reallocarray");
+		for (i = 0; i < njobs; i++) {
+			job = &jobs[i];
+			for (j = job->start; j < job->end; j++)
+				f->first[j] += f->nspans;
+			memcpy(&f->spans[f->nspans], job->spans,
+			    job->nspans * sizeof(struct span));
+			f->nspans += job->nspans;
+			memcpy(&f->changed[f->nchanged], job->changed,
+			    job->nchanged * sizeof(int));
+			f->nchanged += job->nchanged;
+			free(job->spans);
+			free(job->changed);
+		}
+	}
+	f->first[cur->nlines] = f->nspans;
+	free(jobs);
+	if (top_column > 0)
+		top_lines(f);
+
+	return (f);
+}
+
+/*
+ * Compute the spans of the lines in the job.  The index of the first span
+ * of each line is relative to the job.
+ */
+void
+diff_chunk(struct diffjob *job)
+{
+	int		 i, n, changed, row = -1;
+	u_int		 age;
+	struct frame	*f = job->f;
+	struct snapshot	*cur = f->cur, *prev = f->prev, *base = f->base;
+	struct span	 spans[MAXCOLUMN + 1], *nspans;
+
+	if ((job->changed = reallocarray(NULL, MAX(job->end - job->start, 1),
+	    sizeof(int))) == NULL)
+		err(EX_OSERR, "reallocarray");
+	for (i = job->start; i < job->end; i++) {
+		f->first[i] = job->nspans;
+		if (table_key > 0) {
+			/* compare with the row of the same key */
+			row = table_row((base != NULL)? base : prev, cur, i);
+			changed = row == -1 || ((base != NULL)? base : prev)->
+			    hash[row] != cur->hash[i];
+		} else if (base != NULL)
+			changed = baseline_changed(base, cur, i);
+		else if (f->heat)
+			changed = lineage[i].changed != 0 &&
+			    cur->tick - lineage[i].changed < f->heat_ticks;
+		else
+			changed = cur != prev && (i >= prev->nlines ||
+			    cur->hash[i] != prev->hash[i]);
+		if (changed)
+			job->changed[job->nchanged++] = i;
+
+		if (f->heat) {
+			age = cur->tick - lineage[i].changed;
+			f->churn[i] = lineage[i].churn;
+			f->churn_attr[i] = (lineage[i].changed != 0 &&
+			    age < f->heat_ticks)?
+			    heat_attr(age, f->heat_ticks) : A_NORMAL;
+		}
+		if (f->heat && base == NULL && table_key == 0)
+			n = heat_line(cur->buf[i], i, job->reverse, cur->tick,
+			    f->heat_ticks, spans);
+		else if (job->reverse == REVERSE_NONE || !changed)
+			n = 0;	/* unchanged lines are not compared */
+		else if (table_key > 0)
+			n = diff_cells(cur, i, (base != NULL)? base : prev,
+			    row, job->reverse, spans);
+		else
+			n = diff_line(cur->buf[i], snapshot_line(
+			    (base != NULL)? base : prev, i), job->reverse,
+			    spans);
+		if (n == 0)
+			continue;
+		if (job->nspans + n > job->size) {
+			job->size = MAX(job->size * 2, job->nspans + n);
+			if ((nspans = reallocarray(job->spans, job->size,
+			    sizeof(struct span))) == NULL)
+				err(EX_OSERR, "reallocarray");
+			job->spans = nspans;
+		}
+		memcpy(&job->spans[job->nspans], spans,
+		    n * sizeof(struct span));
+		job->nspans += n;
+	}
+}
+
+/* run the jobs by the threads and the caller, and wait for them */
+void
+pool_run(struct diffjob *jobs, int njobs)
+{
+	int	 i;
+	u_int	 gen;
+
+	if (!pool_started) {
+		for (i = 1; i < diff_threads; i++)
+			spawn_thread(pool_main);
+		pool_started = 1;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	pool_jobs = jobs;
+	pool_njobs = njobs;
+	pool_next = pool_done = 0;
+	gen = ++pool_gen;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	pool_work(gen);
+
+	pthread_mutex_lock(&pool_lock);
+	while (pool_done < pool_njobs)
+		pthread_cond_wait(&pool_done_cond, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* take the jobs of the run until they are exhausted */
+void
+pool_work(u_int gen)
+{
+	struct diffjob	*job;
+
+	pthread_mutex_lock(&pool_lock);
+	while (pool_gen == gen && pool_next < pool_njobs) {
+		job = &pool_jobs[pool_next++];
+		pthread_mutex_unlock(&pool_lock);
+		diff_chunk(job);
+		pthread_mutex_lock(&pool_lock);
+		if (++pool_done == pool_njobs)
+			pthread_cond_signal(&pool_done_cond);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void *
+pool_main(void *arg)
+{
+	u_int	 gen = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&pool_lock);
+		while (pool_gen == gen)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		gen = pool_gen;
+		pthread_mutex_unlock(&pool_lock);
+		pool_work(gen);
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/* create the thread.  the signals are handled by the main thread */
+void
+spawn_thread(void *(*start)(void *))
+{
+	pthread_t	 thread;
+	sigset_t	 set, oset;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	if ((errno = pthread_create(&thread, NULL, start, NULL)) != 0)
+		err(EX_OSERR, "pthread_create");
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	pthread_detach(thread);
+}
+
+/* grow the history of the changes for the lines */
+void
+lineage_reserve(int nlines)
+{
+	struct lineage	*la;
+
+	if (nlines <= nlineage)
+		return;
+	nlines = MAX(nlines, nlineage * 2);
+	if ((la = reallocarray(lineage, nlines, sizeof(*la))) == NULL)
+		err(EX_OSERR, "reallocarray");
+	memset(&la[nlineage], 0, (nlines - nlineage) * sizeof(*la));
+	lineage = la;
+	nlineage = nlines;
+}
+
+/* whether the frame is made for the other modes than the current */
+int
+frame_stale(struct frame *f)
+{
+	return (f->reverse != reverse_mode || f->heat != heat_mode ||
+	    (heat_mode && f->heat_ticks != heat_ticks) || f->base != baseline);
+}
+
+/* read the output saved in the file as the baseline */
+struct snapshot *
+load_baseline(const char *path)
+{
+	FILE		*fp;
+	struct stat	 st;
+	struct snapshot	*snap;
+	wchar_t		 line[MAXCOLUMN + 1];
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(EX_NOINPUT, "%s", path);
+	snap = snapshot_new();
+	while (fgetws(line, MAXCOLUMN, fp) != NULL) {
+		untabify(line, sizeof(line));
+		snapshot_append(snap, line);
+	}
+	if (ferror(fp))
+		err(EX_IOERR, "%s", path);
+	if (fstat(fileno(fp), &st) == 0)
+		snap->time = st.st_mtime;
+	fclose(fp);
+	snapshot_digest(snap);
+
+	return (snap);
+}
+
+/*
+ * Pin the snapshot as the baseline, or unpin it with NULL.  The index of
+ * the hashes is made once here, so that the lines moved from the baseline
+ * are found as fast as comparing with the previous output.  The reference
+ * is taken over.
+ */
+void
+pin_baseline(struct snapshot *snap)
+{
+	int		 i;
+	size_t		 j;
+	struct snapshot	*old;
+
+	if (snap != NULL && table_key > 0)
+		table_split(snap);
+	if (snap != NULL && snap->index == NULL) {
+		for (snap->isize = 64; snap->isize < (size_t)snap->nlines * 2;)
+			snap->isize *= 2;
+		if ((snap->index = calloc(snap->isize, sizeof(uint64_t)))
+		    == NULL)
+			err(EX_OSERR, "calloc");
+		for (i = 0; i < snap->nlines; i++) {
+			for (j = snap->hash[i] & (snap->isize - 1);
+			    snap->index[j] != 0 &&
+			    snap->index[j] != snap->hash[i];
+			    j = (j + 1) & (snap->isize - 1))
+				;
+			snap->index[j] = snap->hash[i];
+		}
+	}
+
+	pthread_mutex_lock(&baseline_lock);
+	old = baseline;
+	baseline = snap;
+	pthread_mutex_unlock(&baseline_lock);
+	snapshot_release(old);
+}
+
+/* whether the line is in the baseline neither at the same place nor moved */
+int
+baseline_changed(struct snapshot *base, struct snapshot *cur, int line)
+{
+	size_t		 i;
+	uint64_t	 hash = cur->hash[line];
+
+	if (line < base->nlines && base->hash[line] == hash)
+		return (0);
+	for (i = hash & (base->isize - 1); base->index[i] != 0;
+	    i = (i + 1) & (base->isize - 1)) {
+		if (base->index[i] == hash)
+			return (0);
+	}
+
+	return (1);
+}
+
+void
+frame_free(struct frame *f)
+{
+	if (f == NULL)
+		return;
+	snapshot_release(f->cur);
+	snapshot_release(f->prev);
+	snapshot_release(f->base);
+	free(f->first);
+	free(f->spans);
+	free(f->churn);
+	free(f->churn_attr);
+	free(f->changed);
+	free(f->top);
+	free(f);
+}
+
+/* returns -1 if the queue is full */
+int
+spsc_push(struct spsc_queue *q, void *p)
+{
+	u_int	 tail = q->tail;
+
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >=
+	    PIPELINE_DEPTH)
+		return (-1);
+	q->slot[tail % PIPELINE_DEPTH] = p;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+/* returns NULL if the queue is empty */
+void *
+spsc_pop(struct spsc_queue *q)
+{
+	u_int	 head = q->head;
+	void	*p;
+
+	if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+	p = q->slot[head % PIPELINE_DEPTH];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	return (p);
+}
+
+/* wake up the thread waiting for the pipe */
+void
+wakeup(int *fds, char c)
+{
+	while (write(fds[1], &c, 1) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Read all the characters in the pipe.  Returns whether any of the
+ * characters in chars is read.
+ */
+int
+drain(int *fds, const char *chars)
+{
+	int	 i, found = 0;
+	ssize_t	 n;
+	char	 buf[64];
+
+	while ((n = read(fds[0], buf, sizeof(buf))) > 0 ||
+	    (n == -1 && errno == EINTR)) {
+		for (i = 0; chars != NULL && i < n; i++) {
+			if (strchr(chars, buf[i]) != NULL)
+				found = 1;
+		}
+	}
+
+	return (found);
+}
+
+/* make the pipe to wake up the thread */
+void
+make_pipe(int *fds)
+{
+	int	 i;
+
+	if (pipe(fds) == -1)
+		err(EX_OSERR, "pipe()");
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+}
+
+void
+snapshot_append(struct snapshot *snap, const wchar_t *line)
+{
+	if (snap->nlines == snap->size) {
+		snap->size = MAX(snap->size * 2, 64);
+		if ((snap->buf = reallocarray(snap->buf, snap->size,
+		    sizeof(wchar_t *))) == NULL ||
+		    (snap->hash = reallocarray(snap->hash, snap->size,
+		    sizeof(uint64_t))) == NULL)
+			err(EX_OSERR, "reallocarray");
+	}
+	if ((snap->buf[snap->nlines] = wcsdup(line)) == NULL)
+		err(EX_OSERR, "wcsdup");
+	snap->hash[snap->nlines++] = line_hash(line);
+}
+
+/* hash of the all lines */
+void
+snapshot_digest(struct snapshot *snap)
+{
+	int	 i;
+
+	for (i = 0, snap->digest = 0xcbf29ce484222325ULL; i < snap->nlines;
+	    i++) {
+		snap->digest ^= snap->hash[i];
+		snap->digest *= 0x100000001b3ULL;
+	}
+}
+
+int
+socket_address(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (snprintf(sun->sun_path, sizeof(sun->sun_path), "%s", path) >=
+	    (int)sizeof(sun->sun_path))
+		errx(EX_USAGE, "%s: path too long", path);
+
+	return (socket(AF_UNIX, SOCK_STREAM, 0));
+}
+
+/* listen on the control socket and start the server thread */
+void
+server_open(void)
+{
+	int			 fd;
+	mode_t			 omask;
+	struct sockaddr_un	 sun;
+	struct stat		 st;
+
+	/* remove the socket left, unless it is used */
+	if (lstat(server_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if ((fd = socket_address(&sun, server_path)) == -1)
+			err(EX_OSERR, "socket");
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+			errx(EX_UNAVAILABLE, "%s: in use", server_path);
+		close(fd);
+		unlink(server_path);
+	}
+	if ((server_fd = socket_address(&sun, server_path)) == -1)
+		err(EX_OSERR, "socket");
+	/* the output is served to the owner only */
+	omask = umask(077);
+	if (bind(server_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(EX_CANTCREAT, "%s", server_path);
+	umask(omask);
+	if (listen(server_fd, 16) == -1)
+		err(EX_OSERR, "listen");
+	fcntl(server_fd, F_SETFL, O_NONBLOCK);
+	fcntl(server_fd, F_SETFD, FD_CLOEXEC);
+#if defined(NO_MSG_NOSIGNAL) && !defined(SO_NOSIGPIPE)
+	/* not to be killed by sending to the client closed */
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	make_pipe(server_pipe);
+	spawn_thread(server_main);
+}
+
+/* pass the latest output to the server thread */
+void
+server_publish(struct snapshot *snap)
+{
+	pthread_mutex_lock(&server_lock);
+	snapshot_release(server_pending);
+	server_pending = snapshot_ref(snap);
+	pthread_mutex_unlock(&server_lock);
+	wakeup(server_pipe, 's');
+}
+
+void *
+server_main(void *arg)
+{
+	int		 i, maxfd, drop;
+	fd_set		 rfds, wfds;
+	struct client	*c;
+
+	for (;;) {
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(server_fd, &rfds);
+		FD_SET(server_pipe[0], &rfds);
+		maxfd = MAX(server_fd, server_pipe[0]);
+		for (i = 0; i < nclients; i++) {
+			c = clients[i];
+			FD_SET(c->fd, &rfds);
+			if (c->qlen > 0)
+				FD_SET(c->fd, &wfds);
+			maxfd = MAX(maxfd, c->fd);
+		}
+		if (select(maxfd + 1, &rfds, &wfds, NULL, NULL) == -1)
+			continue;
+
+		if (FD_ISSET(server_pipe[0], &rfds)) {
+			drain(server_pipe, NULL);
+			server_update();
+		}
+		if (FD_ISSET(server_fd, &rfds))
+			server_accept();
+		for (i = 0; i < nclients;) {
+			c = clients[i];
+			drop = (FD_ISSET(c->fd, &rfds) &&
+			    client_read(c) == -1) ||
+			    (FD_ISSET(c->fd, &wfds) && client_write(c) == -1);
+			if (drop) {
+				client_free(c);
+				clients[i] = clients[--nclients];
+			} else
+				i++;
+		}
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * Take the output published and send the changes to the subscribers.  The
+ * message is made once for all of them.
+ */
+void
+server_update(void)
+{
+	int		 i, nhunks;
+	struct snapshot	*snap, *prev;
+	struct client	*c;
+	struct message	*msg;
+	static struct wbuf wb;
+
+	pthread_mutex_lock(&server_lock);
+	snap = server_pending;
+	server_pending = NULL;
+	pthread_mutex_unlock(&server_lock);
+	if (snap == NULL)
+		return;
+
+	prev = server_cur;
+	server_cur = snap;
+	message_release(server_snapmsg);
+	server_snapmsg = NULL;
+	if (prev != NULL && prev->digest != snap->digest) {
+		nhunks = diff_hunks(&wb, snap, prev);
+		wbuf_printf(&wb, "\n");
+		msg = message_new(&wb, "diff %u %lld %d %d %d\n", snap->tick,
+		    (long long)snap->time, snap->nlines, nhunks,
+		    snap->run.status);
+		message_release(server_diffmsg);
+		server_diffmsg = msg;
+	} else
+		msg = NULL;
+	snapshot_release(prev);
+
+	for (i = 0; i < nclients;) {
+		c = clients[i];
+		if (c->subscribed && !c->synced) {
+			if (server_snapmsg == NULL)
+				server_snapmsg = snapshot_message(server_cur);
+			c->synced = 1;
+			if (client_send(c, server_snapmsg) == -1)
+				goto drop;
+		} else if (c->subscribed && msg != NULL &&
+		    client_send(c, msg) == -1)
+			goto drop;
+		i++;
+		continue;
+drop:
+		/* the subscriber which can't catch up is dropped */
+		client_free(c);
+		clients[i] = clients[--nclients];
+	}
+}
+
+void
+server_accept(void)
+{
+	int		 fd;
+	struct client	*c;
+#ifdef SO_NOSIGPIPE
+	int		 on = 1;
+#endif
+
+	if ((fd = accept(server_fd, NULL, NULL)) == -1)
+		return;
+	if (nclients >= MAXCLIENTS) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(EX_OSERR, "calloc");
+	c->fd = fd;
+	clients[nclients++] = c;
+}
+
+/*
+ * Read the request.  The input after the request is discarded.  Returns -1
+ * if the client is to be closed.
+ */
+int
+client_read(struct client *c)
+{
+	ssize_t	 n;
+	char	*p, buf[64];
+
+	if (c->subscribed || c->closing)
+		n = read(c->fd, buf, sizeof(buf));
+	else
+		n = read(c->fd, c->req + c->reqlen,
+		    sizeof(c->req) - 1 - c->reqlen);
+	if (n == -1)
+		return ((errno == EAGAIN || errno == EINTR)? 0 : -1);
+	if (n == 0)
+		return (-1);
+	if (c->subscribed || c->closing)
+		return (0);
+
+	c->reqlen += n;
+	c->req[c->reqlen] = '\0';
+	if ((p = strchr(c->req, '\n')) == NULL)
+		return ((c->reqlen < sizeof(c->req) - 1)? 0 : -1);
+	*p = '\0';
+	if (p > c->req && p[-1] == '\r')
+		p[-1] = '\0';
+	server_request(c);
+
+	return (0);
+}
+
+/*
+ * Answer the request:
+ *	snapshot	the current output
+ *	diff		the last change of the output
+ *	info		the metadata of the current output
+ *	subscribe	the current output and the changes after it
+ */
+void
+server_request(struct client *c)
+{
+	struct message	*msg = NULL;
+	struct snapshot	*snap = server_cur;
+	static struct wbuf wb;
+
+	c->closing = 1;
+	if (strcmp(c->req, "subscribe") == 0) {
+		c->closing = 0;
+		c->subscribed = 1;
+		msg = message_new(&wb, "command %s\n", cmdstr);
+		client_send(c, msg);
+		message_release(msg);
+		if (snap == NULL)
+			return;		/* sent with the first output */
+		if (server_snapmsg == NULL)
+			server_snapmsg = snapshot_message(snap);
+		client_send(c, server_snapmsg);
+		c->synced = 1;
+		return;
+	} else if (snap == NULL)
+		msg = message_new(&wb, "error no output yet\n");
+	else if (strcmp(c->req, "snapshot") == 0) {
+		if (server_snapmsg == NULL)
+			server_snapmsg = snapshot_message(snap);
+		client_send(c, server_snapmsg);
+	} else if (strcmp(c->req, "diff") == 0) {
+		if (server_diffmsg != NULL)
+			client_send(c, server_diffmsg);
+		else
+			msg = message_new(&wb, "error no change yet\n");
+	} else if (strcmp(c->req, "info") == 0)
+		msg = message_new(&wb,
+		    "command %s\ntick %u\ntime %lld\nlines %d\n"
+		    "digest %016llx\nstatus %d\nwall %.3f\nclients %d\n",
+		    cmdstr, snap->tick, (long long)snap->time, snap->nlines,
+		    (unsigned long long)snap->digest, snap->run.status,
+		    snap->run.wall, nclients);
+	else
+		msg = message_new(&wb, "error unknown request\n");
+	if (msg != NULL) {
+		client_send(c, msg);
+		message_release(msg);
+	}
+}
+
+/* send the queued messages.  returns -1 if the client is to be closed */
+int
+client_write(struct client *c)
+{
+	ssize_t		 n;
+	struct message	*msg;
+
+	while (c->qlen > 0) {
+		msg = c->queue[c->qhead];
+		n = send(c->fd, msg->data + c->off, msg->len - c->off,
+		    MSG_NOSIGNAL);
+		if (n == -1)
+			return ((errno == EAGAIN || errno == EINTR)? 0 : -1);
+		if ((c->off += n) < msg->len)
+			return (0);
+		message_release(msg);
+		c->qhead = (c->qhead + 1) % CLIENT_QUEUE;
+		c->qlen--;
+		c->off = 0;
+	}
+
+	return ((c->closing)? -1 : 0);
+}
+
+/* queue the message.  returns -1 if the queue is full */
+int
+client_send(struct client *c, struct message *msg)
+{
+	if (c->qlen >= CLIENT_QUEUE)
+		return (-1);
+	msg->refcnt++;
+	c->queue[(c->qhead + c->qlen++) % CLIENT_QUEUE] = msg;
+
+	return (0);
+}
+
+void
+client_free(struct client *c)
+{
+	for (; c->qlen > 0; c->qlen--) {
+		message_release(c->queue[c->qhead]);
+		c->qhead = (c->qhead + 1) % CLIENT_QUEUE;
+	}
+	close(c->fd);
+	free(c);
+}
+
+/* make the message of the header and the data in the buffer */
+struct message *
+message_new(struct wbuf *wb, const char *fmt, ...)
+{
+	int		 len;
+	va_list		 ap;
+	struct message	*msg;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if ((msg = malloc(sizeof(*msg) + len + 1 + wb->len)) == NULL)
+		err(EX_OSERR, "malloc");
+	va_start(ap, fmt);
+	vsnprintf(msg->data, len + 1, fmt, ap);
+	va_end(ap);
+	memcpy(msg->data + len, wb->buf, wb->len);
+	msg->len = len + wb->len;
+	msg->refcnt = 1;
+	wb->len = 0;
+
+	return (msg);
+}
+
+void
+message_release(struct message *msg)
+{
+	if (msg != NULL && --msg->refcnt == 0)
+		free(msg);
+}
+
+struct message *
+snapshot_message(struct snapshot *snap)
+{
+	int		 i;
+	static struct wbuf wb;
+
+	/* as the context lines, so that the lines are sent exactly */
+	for (i = 0; i < snap->nlines; i++)
+		difflog_line(&wb, ' ', snap->buf[i]);
+	wbuf_printf(&wb, "\n");	/* the end of the message */
+
+	return (message_new(&wb, "snapshot %u %lld %d %d\n", snap->tick,
+	    (long long)snap->time, snap->nlines, snap->run.status));
+}
+
+/* subscribe the outputs from the control socket */
+void
+viewer_open(void)
+{
+	int			 fd;
+	char			*p, buf[BUFSIZ];
+	struct sockaddr_un	 sun;
+
+	if ((fd = socket_address(&sun, viewer_path)) == -1)
+		err(EX_OSERR, "socket");
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(EX_UNAVAILABLE, "%s", viewer_path);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (write(fd, "subscribe\n", 10) != 10)
+		err(EX_IOERR, "%s", viewer_path);
+	if ((viewer_fp = fdopen(fd, "r")) == NULL)
+		err(EX_OSERR, "fdopen()");
+
+	if (fgets(buf, sizeof(buf), viewer_fp) == NULL ||
+	    strncmp(buf, "command ", 8) != 0)
+		errx(EX_PROTOCOL, "%s: unexpected response", viewer_path);
+	if ((p = strchr(buf, '\n')) != NULL)
+		*p = '\0';
+	if ((cmdstr = strdup(buf + 8)) == NULL)
+		err(EX_OSERR, "strdup");
+}
+
+/*
+ * Read a line of the message with the sign into the line of MAXCOLUMN + 2.
+ * The newline is removed if the line is marked not to have it.  The mark
+ * is looked ahead without waiting, as the message ends with an empty line.
+ */
+int
+viewer_line(FILE *fp, wchar_t *line)
+{
+	int	 c;
+	size_t	 len;
+	char	 mbs[(MAXCOLUMN + 1) * MB_LEN_MAX + 2];
+
+	if (fgets(mbs, sizeof(mbs), fp) == NULL)
+		return (-1);
+	if ((c = getc(fp)) == '\\') {
+		while ((c = getc(fp)) != EOF && c != '\n')
+			;
+		len = strlen(mbs);
+		if (len > 0 && mbs[len - 1] == '\n')
+			mbs[len - 1] = '\0';
+	} else if (c != EOF)
+		ungetc(c, fp);
+	if (mbstowcs(line, mbs, MAXCOLUMN + 1) == (size_t)-1) {
+		line[0] = (u_char)mbs[0];	/* the sign only */
+		line[1] = L'\0';
+	}
+	line[MAXCOLUMN + 1] = L'\0';
+	if (line[0] == L'\0')
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Read the output or the change from the control socket.  The change is
+ * applied to the previous output.  Returns -1 if it can't be read.
+ */
+int
+viewer_read(FILE *fp, struct snapshot *prev, struct snapshot *snap)
+{
+	int		 i, j, nlines, nhunks, st, del, ndel, add, nadd;
+	u_int		 tick;
+	long long	 tm;
+	char		 hdr[128];
+	wchar_t		 line[MAXCOLUMN + 2];	/* with the sign */
+
+	if (fgets(hdr, sizeof(hdr), fp) == NULL)
+		return (-1);
+	if (sscanf(hdr, "snapshot %u %lld %d %d", &tick, &tm, &nlines,
+	    &st) == 4 && nlines >= 0) {
+		for (i = 0; i < nlines; i++) {
+			if (viewer_line(fp, line) == -1)
+				return (-1);
+			snapshot_append(snap, line + 1);
+		}
+	} else if (sscanf(hdr, "diff %u %lld %d %d %d", &tick, &tm, &nlines,
+	    &nhunks, &st) == 5 && prev != NULL && nlines >= 0 &&
+	    nhunks >= 0) {
+		for (i = 0; i < nlines; i++)
+			snapshot_append(snap, snapshot_line(prev, i));
+		for (i = 0; i < nhunks; i++) {
+			if (fgets(hdr, sizeof(hdr), fp) == NULL ||
+			    sscanf(hdr, "@@ -%d,%d +%d,%d @@", &del, &ndel,
+			    &add, &nadd) != 4 || del < 0 || ndel < 0 ||
+			    add < 0 || nadd < 0 || ndel > INT_MAX - nadd)
+				return (-1);
+			if (nadd > 0)
+				add--;
+			for (j = 0; j < ndel + nadd; j++) {
+				if (viewer_line(fp, line) == -1)
+					return (-1);
+				if (j < ndel)
+					continue;
+				if (add + j - ndel < 0 ||
+				    add + j - ndel >= nlines)
+					return (-1);
+				free(snap->buf[add + j - ndel]);
+				if ((snap->buf[add + j - ndel] =
+				    wcsdup(line + 1)) == NULL)
+					err(EX_OSERR, "wcsdup");
+				snap->hash[add + j - ndel] =
+				    line_hash(line + 1);
+			}
+		}
+	} else
+		return (-1);
+	if (fgets(hdr, sizeof(hdr), fp) == NULL || strcmp(hdr, "\n") != 0)
+		return (-1);
+
+	snapshot_digest(snap);
+	snap->time = tm;
+	snap->run.status = st;
+	snap->tick = ++ticks;
+
+	return (0);
+}
+
+/* pass the outputs from the control socket to the worker */
+void *
+viewer_main(void *arg)
+{
+	struct snapshot	*snap, *prev = NULL;
+	struct timespec	 ts = { 0, 10000000 };
+
+	for (;;) {
+		snap = snapshot_new();
+		if (viewer_read(viewer_fp, prev, snap) == -1) {
+			snapshot_release(snap);
+			snapshot_release(prev);
+			wakeup(main_pipe, 'q');
+			break;
+		}
+		snapshot_release(prev);
+		prev = snapshot_ref(snap);
+		while (spsc_push(&snap_queue, snap) != 0)
+			nanosleep(&ts, NULL);
+		wakeup(worker_pipe, 's');
+	}
+
+	return (NULL);
+}
+
+/*
+ * Add the field given as "name:column:pattern".  The name must be valid
+ * as the name of the metric.
+ */
+int
+add_field(const char *spec)
+{
+	int		 column;
+	char		*name, *e;
+	const char	*p;
+	struct field	*f;
+
+	if ((p = strchr(spec, ':')) == NULL || p == spec ||
+	    strspn(spec, "abcdefghijklmnopqrstuvwxyz"
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_:") < (size_t)(p - spec) ||
+	    (*spec >= '0' && *spec <= '9'))
+		return (-1);
+	column = strtol(p + 1, &e, 10);
+	if (e == p + 1 || *e != ':' || column <= 0)
+		return (-1);
+
+	if ((f = reallocarray(fields, nfields + 1, sizeof(*f))) == NULL)
+		err(EX_OSERR, "reallocarray");
+	fields = f;
+	f = &fields[nfields];
+	if (regcomp(&f->re, e + 1, REG_EXTENDED | REG_NOSUB | REG_NEWLINE) != 0)
+		return (-1);
+	if ((name = strndup(spec, p - spec)) == NULL)
+		err(EX_OSERR, "strndup");
+	f->name = name;
+	f->column = column;
+	nfields++;
+
+	return (0);
+}
+
+/*
+ * Parse the number at the beginning of the column of the string.  Returns
+ * -1 if there is no number.
+ */
+int
+parse_column(const char *str, int column, double *val)
+{
+	char	*e;
+
+	for (;;) {
+		str += strspn(str, " \t\n");
+		if (*str == '\0')
+			return (-1);
+		if (--column == 0)
+			break;
+		str += strcspn(str, " \t\n");
+	}
+	*val = strtod(str, &e);
+
+	return ((e == str)? -1 : 0);
+}
+
+/* values of the fields in the line, or NULL if no field is in it */
+double *
+parse_fields(const wchar_t *line)
+{
+	int	 i, found = 0;
+	char	 mbs[MAXCOLUMN * MB_LEN_MAX + 1];
+	double	*vals;
+
+	if (wcstombs(mbs, line, sizeof(mbs)) == (size_t)-1)
+		return (NULL);
+	if ((vals = reallocarray(NULL, nfields, sizeof(double))) == NULL)
+		err(EX_OSERR, "reallocarray");
+	for (i = 0; i < nfields; i++) {
+		vals[i] = NAN;
+		if (regexec(&fields[i].re, mbs, 0, NULL, 0) == 0 &&
+		    parse_column(mbs, fields[i].column, &vals[i]) == 0)
+			found = 1;
+	}
+	if (!found) {
+		free(vals);
+		return (NULL);
+	}
+
+	return (vals);
+}
+
+void
+export_open(void)
+{
+	int		 i;
+	struct stat	 st;
+
+	if ((export_vals = reallocarray(NULL, nfields, sizeof(double))) == NULL)
+		err(EX_OSERR, "reallocarray");
+	if (export_prom)
+		return;		/* rewritten on each tick */
+
+	if ((export_fd = open(export_path,
+	    O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		err(EX_CANTCREAT, "%s", export_path);
+	if (fstat(export_fd, &st) == -1)
+		err(EX_IOERR, "%s", export_path);
+	if (st.st_size > 0)
+		return;
+	wbuf_printf(&export_buf, "time");
+	for (i = 0; i < nfields; i++)
+		wbuf_printf(&export_buf, ",%s", fields[i].name);
+	wbuf_printf(&export_buf, "\n");
+	wbuf_flush(&export_buf, export_fd);
+}
+
+/*
+ * Export the values of the fields: the value of a field is taken from the
+ * first line which matches and has the number.  The values are cached by
+ * the hash of the line, so only the changed lines are parsed.
+ */
+void
+export_write(struct snapshot *cur, struct snapshot *prev)
+{
+	int			 i, j, isnew, left;
+	int			 fd, failed;
+	char			 tmp[PATH_MAX];
+	double			*vals;
+	struct lcache_entry	*ent;
+	struct wbuf		*wb = &export_buf;
+
+	if (cur == prev || cur->digest != prev->digest) {
+		for (j = 0; j < nfields; j++)
+			export_vals[j] = NAN;
+		for (i = 0, left = nfields; i < cur->nlines && left > 0; i++) {
+			ent = lcache_lookup(&export_cache, cur->hash[i],
+			    cur->tick, &isnew);
+			if (isnew)
+				ent->data = parse_fields(cur->buf[i]);
+			if ((vals = ent->data) == NULL)
+				continue;
+			for (j = 0; j < nfields; j++) {
+				if (isnan(export_vals[j]) && !isnan(vals[j])) {
+					export_vals[j] = vals[j];
+					left--;
+				}
+			}
+		}
+	}
+
+	if (export_prom) {
+		for (j = 0; j < nfields; j++) {
+			if (isnan(export_vals[j]))
+				continue;
+			wbuf_printf(wb, "# TYPE %s gauge\n%s %.15g\n",
+			    fields[j].name, fields[j].name, export_vals[j]);
+		}
+		/* replace the file at once not to be read halfway */
+		snprintf(tmp, sizeof(tmp), "%s.tmp", export_path);
+		if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0644)) == -1) {
+			wb->len = 0;
+			return;
+		}
+		failed = wbuf_flush(wb, fd) == -1;
+		if (close(fd) == -1)
+			failed = 1;
+		/* the values not written are dropped */
+		if (failed || rename(tmp, export_path) == -1)
+			unlink(tmp);
+		return;
+	}
+
+	wbuf_printf(wb, "%lld", (long long)cur->time);
+	for (j = 0; j < nfields; j++) {
+		if (isnan(export_vals[j]))
+			wbuf_printf(wb, ",");
+		else
+			wbuf_printf(wb, ",%.15g", export_vals[j]);
+	}
+	wbuf_printf(wb, "\n");
+	wbuf_flush(wb, export_fd);
+}
+
+/* find the columns by the words of the header */
+void
+table_columns(const wchar_t *header)
+{
+	int	 i = 0;
+
+	for (table_ncols = 0; table_ncols < (int)nitems(table_cols);
+	    table_ncols++) {
+		while (iswspace(header[i]))
+			i++;
+		if (header[i] == L'\0')
+			break;
+		table_cols[table_ncols].start = i;
+		while (header[i] != L'\0' && !iswspace(header[i]))
+			i++;
+		table_cols[table_ncols].end = i;
+	}
+}
+
+/*
+ * Split the line into the fields.  A word belongs to the column which it
+ * overlaps most in the header, or the nearest one, so that the fields
+ * aligned to either side are found.  The last field is until the end of
+ * the line.
+ */
+void
+split_row(const wchar_t *line, struct cell *cells)
+{
+	int	 i = 0, c, best, start, end, score, max;
+
+	memset(cells, 0, table_ncols * sizeof(struct cell));
+	for (;;) {
+		while (iswspace(line[i]))
+			i++;
+		if (line[i] == L'\0')
+			break;
+		start = i;
+		while (line[i] != L'\0' && !iswspace(line[i]))
+			i++;
+		end = i;
+
+		/* the overlap, or minus the distance */
+		for (best = 0, max = INT_MIN, c = 0; c < table_ncols; c++) {
+			score = MIN(end, table_cols[c].end) -
+			    MAX(start, table_cols[c].start);
+			if (score > max) {
+				max = score;
+				best = c;
+			}
+		}
+		if (best == table_ncols - 1) {
+			for (end = wcslen(line); iswspace(line[end - 1]); end--)
+				;
+			i = end;
+		}
+		if (cells[best].start == cells[best].end)
+			cells[best].start = start;
+		cells[best].end = end;
+	}
+}
+
+/*
+ * Split the lines of the snapshot into the fields and index them by the
+ * key field.  The fields of each line are kept by the hash of the line, so
+ * only the changed lines are split.
+ */
+void
+table_split(struct snapshot *snap)
+{
+	int			 i, isnew;
+	size_t			 j;
+	uint64_t		 key;
+	const wchar_t		*p;
+	struct cell		*c;
+	struct lcache_entry	*ent;
+
+	if (snap->nlines == 0 || snap->cells != NULL)
+		return;
+	/* the columns are found again if the header is changed */
+	if (snap->hash[0] != table_header) {
+		table_columns(snap->buf[0]);
+		table_header = snap->hash[0];
+		lcache_clear(&table_cache);
+	}
+
+	snap->ncells = table_ncols;
+	for (snap->ksize = 64; snap->ksize < (size_t)snap->nlines * 2;)
+		snap->ksize *= 2;
+	if ((snap->cells = reallocarray(NULL, snap->nlines,
+	    MAX(table_ncols, 1) * sizeof(struct cell))) == NULL ||
+	    (snap->keys = reallocarray(NULL, snap->nlines,
+	    sizeof(uint64_t))) == NULL ||
+	    (snap->kindex = calloc(snap->ksize, sizeof(int))) == NULL)
+		err(EX_OSERR, "reallocarray");
+	for (i = 0; i < snap->nlines; i++) {
+		ent = lcache_lookup(&table_cache, snap->hash[i], snap->tick,
+		    &isnew);
+		if (isnew) {
+			if ((ent->data = reallocarray(NULL,
+			    MAX(table_ncols, 1), sizeof(struct cell))) == NULL)
+				err(EX_OSERR, "reallocarray");
+			split_row(snap->buf[i], ent->data);
+		}
+		c = &snap->cells[i * table_ncols];
+		memcpy(c, ent->data, table_ncols * sizeof(struct cell));
+
+		snap->keys[i] = 0;
+		if (table_key > table_ncols ||
+		    c[table_key - 1].start == c[table_key - 1].end)
+			continue;
+		key = 0xcbf29ce484222325ULL;
+		for (p = &snap->buf[i][c[table_key - 1].start];
+		    p < &snap->buf[i][c[table_key - 1].end]; p++) {
+			key ^= (uint64_t)*p;
+			key *= 0x100000001b3ULL;
+		}
+		snap->keys[i] = (key == 0)? 1 : key;
+		for (j = snap->keys[i] & (snap->ksize - 1);
+		    snap->kindex[j] != 0;
+		    j = (j + 1) & (snap->ksize - 1))
+			;
+		snap->kindex[j] = i + 1;
+	}
+}
+
+/*
+ * The line of prev to be compared with the line of cur: the same line or
+ * the first line of the same key, or -1 if the key is not found.  The
+ * line without the key is compared with the line at the same position.
+ */
+int
+table_row(struct snapshot *prev, struct snapshot *cur, int line)
+{
+	int		 row = -1, r;
+	size_t		 i;
+	uint64_t	 key = cur->keys[line];
+
+	if (line < prev->nlines && prev->hash[line] == cur->hash[line])
+		return (line);
+	if (key == 0 || prev->kindex == NULL)
+		return ((line < prev->nlines)? line : -1);
+	for (i = key & (prev->ksize - 1); (r = prev->kindex[i]) != 0;
+	    i = (i + 1) & (prev->ksize - 1)) {
+		if (prev->keys[r - 1] != key)
+			continue;
+		if (prev->hash[r - 1] == cur->hash[line])
+			return (r - 1);
+		if (row == -1)
+			row = r - 1;
+	}
+
+	return (row);
+}
+
+/* highlight the fields of the line which differ from the row of prev */
+int
+diff_cells(struct snapshot *cur, int line, struct snapshot *prev, int row,
+    reverse_mode_t reverse, struct span *spans)
+{
+	int		 c, n = 0;
+	struct cell	*cc, *pc;
+
+	if (reverse == REVERSE_NONE)
+		return (0);
+	if (row == -1) {
+		/* new row */
+		spans[0].start = 0;
+		spans[0].end = SPAN_EOL;
+		spans[0].attr = style;
+		return (1);
+	}
+	if (reverse == REVERSE_LINE || cur->ncells != prev->ncells)
+		return (diff_line(cur->buf[line], prev->buf[row],
+		    REVERSE_LINE, spans));
+
+	cc = &cur->cells[line * cur->ncells];
+	pc = &prev->cells[row * prev->ncells];
+	for (c = 0; c < cur->ncells; c++) {
+		if (cc[c].start == cc[c].end ||
+		    (cc[c].end - cc[c].start == pc[c].end - pc[c].start &&
+		    wmemcmp(&cur->buf[line][cc[c].start],
+		    &prev->buf[row][pc[c].start], cc[c].end - cc[c].start)
+		    == 0))
+			continue;
+		spans[n].start = cc[c].start;
+		spans[n].end = cc[c].end;
+		spans[n].attr = style;
+		n++;
+	}
+
+	return (n);
+}
+
+/* parse "column[:count]" of the sorted view */
+int
+parse_top(const char *spec)
+{
+	long	 column, count = DEFAULT_TOP_COUNT;
+	char	*e;
+
+	errno = 0;
+	column = strtol(spec, &e, 10);
+	if (e == spec || errno != 0 || column <= 0 || column > MAXCOLUMN)
+		return (-1);
+	if (*e == ':') {
+		spec = e + 1;
+		count = strtol(spec, &e, 10);
+		if (e == spec || errno != 0 || count <= 0 || count > INT_MAX)
+			return (-1);
+	}
+	if (*e != '\0')
+		return (-1);
+	top_column = column;
+	top_count = count;
+
+	return (0);
+}
+
+/* number in the column of the line, or NAN.  kept by the hash of line */
+double
+top_number(struct snapshot *snap, int line)
+{
+	int			 isnew;
+	char			 mbs[MAXCOLUMN * MB_LEN_MAX + 1];
+	double			*val;
+	struct lcache_entry	*ent;
+
+	ent = lcache_lookup(&top_cache, snap->hash[line], snap->tick, &isnew);
+	if (isnew) {
+		if ((val = malloc(sizeof(double))) == NULL)
+			err(EX_OSERR, "malloc");
+		if (wcstombs(mbs, snap->buf[line], sizeof(mbs)) == (size_t)-1 ||
+		    parse_column(mbs, top_column, val) != 0)
+			*val = NAN;
+		ent->data = val;
+	}
+
+	return (*(double *)ent->data);
+}
+
+/* whether the line a is ranked lower than b.  the former line is higher */
+int
+top_less(int a, int b)
+{
+	return (top_val[a] < top_val[b] ||
+	    (top_val[a] == top_val[b] && a > b));
+}
+
+/* whether the line a is put nearer to the root of the heap than b */
+int
+top_above(struct topheap *h, int a, int b)
+{
+	return ((h->rest)? top_less(b, a) : top_less(a, b));
+}
+
+/*
+ * Put the line at the index of the heap.  The index in top_rest is kept
+ * as -2 - k in top_pos.
+ */
+void
+top_set(struct topheap *h, int k, int line)
+{
+	h->line[k] = line;
+	top_pos[line] = (h->rest)? -2 - k : k;
+}
+
+/* move the line at the index up or down to its place in the heap */
+void
+top_sift(struct topheap *h, int k)
+{
+	int	 c, p, line = h->line[k];
+
+	for (; k > 0; k = p) {
+		p = (k - 1) / 2;
+		if (!top_above(h, line, h->line[p]))
+			break;
+		top_set(h, k, h->line[p]);
+	}
+	for (; (c = k * 2 + 1) < h->n; k = c) {
+		if (c + 1 < h->n && top_above(h, h->line[c + 1], h->line[c]))
+			c++;
+		if (!top_above(h, h->line[c], line))
+			break;
+		top_set(h, k, h->line[c]);
+	}
+	top_set(h, k, line);
+}
+
+void
+top_push(struct topheap *h, int line)
+{
+	top_set(h, h->n++, line);
+	top_sift(h, h->n - 1);
+}
+
+/* take the line out of the heap which has it */
+void
+top_remove(int line)
+{
+	int		 k = top_pos[line];
+	struct topheap	*h = &top_heap;
+
+	if (k == -1)
+		return;
+	if (k < -1) {
+		h = &top_rest;
+		k = -2 - k;
+	}
+	top_pos[line] = -1;
+	if (k < --h->n) {
+		top_set(h, k, h->line[h->n]);
+		top_sift(h, k);
+	}
+}
+
+/*
+ * Move the line whose value is changed to its place, and exchange the
+ * lines between the heaps so that top_heap has the top_count lines ranked
+ * higher than any line in top_rest.
+ */
+void
+top_place(int line)
+{
+	int	 k = top_pos[line], in, out;
+
+	if (isnan(top_val[line]))
+		top_remove(line);
+	else if (k == -1)
+		top_push(&top_rest, line);
+	else if (k < -1)
+		top_sift(&top_rest, -2 - k);
+	else
+		top_sift(&top_heap, k);
+
+	while (top_rest.n > 0 && (top_heap.n < top_count ||
+	    top_less(top_heap.line[0], top_rest.line[0]))) {
+		in = top_rest.line[0];
+		top_remove(in);
+		if (top_heap.n == top_count) {
+			out = top_heap.line[0];
+			top_remove(out);
+			top_push(&top_rest, out);
+		}
+		top_push(&top_heap, in);
+	}
+}
+
+/*
+ * Update the values and the heaps for the snapshot.  The lines are parsed
+ * and moved in the heaps only if they are changed from the last snapshot,
+ * or their rates are.  The lines appended or removed at the end are put
+ * into or taken out of the heaps alone.
+ */
+void
+top_update(struct snapshot *cur)
+{
+	int		 i, n, row, dticks;
+	double		 val, *d;
+	struct snapshot	*last = top_snap;
+
+	if (last == cur)
+		return;
+	if (cur->nlines > top_size) {
+		n = top_size;
+		top_size = MAX(cur->nlines, top_size * 2);
+		if ((top_num = reallocarray(top_num, top_size,
+		    sizeof(double))) == NULL ||
+		    (top_oldnum = reallocarray(top_oldnum, top_size,
+		    sizeof(double))) == NULL ||
+		    (top_val = reallocarray(top_val, top_size,
+		    sizeof(double))) == NULL ||
+		    (top_pos = reallocarray(top_pos, top_size,
+		    sizeof(int))) == NULL ||
+		    (top_heap.line = reallocarray(top_heap.line,
+		    MIN(top_size, top_count), sizeof(int))) == NULL ||
+		    (top_rest.line = reallocarray(top_rest.line, top_size,
+		    sizeof(int))) == NULL)
+			err(EX_OSERR, "reallocarray");
+		for (i = n; i < top_size; i++)
+			top_pos[i] = -1;
+	}
+	d = top_oldnum;
+	top_oldnum = top_num;
+	top_num = d;
+	n = (last != NULL)? last->nlines : 0;
+	for (i = cur->nlines; i < n; i++)
+		top_remove(i);
+	dticks = (last != NULL && cur->tick > last->tick)?
+	    cur->tick - last->tick : 1;
+
+	for (i = 0; i < cur->nlines; i++) {
+		if (i < n && cur->hash[i] == last->hash[i]) {
+			top_num[i] = top_oldnum[i];
+			/* only the rate of the unchanged line is changed */
+			if (!top_rate || top_val[i] == 0)
+				continue;
+		} else
+			top_num[i] = top_number(cur, i);
+
+		val = top_num[i];
+		if (top_rate) {
+			/* compare with the row of the same key if a table */
+			if (last == NULL)
+				row = -1;
+			else if (table_key > 0)
+				row = table_row(last, cur, i);
+			else
+				row = (i < n)? i : -1;
+			val = (row == -1)? NAN :
+			    (val - top_oldnum[row]) / dticks;
+		}
+		if (i < n && ((isnan(val) && isnan(top_val[i])) ||
+		    val == top_val[i]))
+			continue;
+		top_val[i] = val;
+		top_place(i);
+	}
+	snapshot_release(top_snap);
+	top_snap = snapshot_ref(cur);
+}
+
+int
+top_compar(const void *a, const void *b)
+{
+	return (top_less(*(const int *)b, *(const int *)a)? -1 : 1);
+}
+
+/*
+ * Set the lines of the sorted view to the frame.  The first line is shown
+ * on the top as the header if it doesn't have the number.
+ */
+void
+top_lines(struct frame *f)
+{
+	int	 header;
+
+	top_update(f->cur);
+	header = f->cur->nlines > 0 && isnan(top_num[0]);
+	if ((f->top = reallocarray(NULL, top_heap.n + 1, sizeof(int))) == NULL)
+		err(EX_OSERR, "reallocarray");
+	if (header)
+		f->top[0] = 0;
+	memcpy(&f->top[header], top_heap.line, top_heap.n * sizeof(int));
+	qsort(&f->top[header], top_heap.n, sizeof(int), top_compar);
+	f->ntop = top_heap.n + header;
 }
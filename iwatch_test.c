@@ -14,6 +14,31 @@
 #include <wchar.h>
 
 void (*watch_untabify)(wchar_t *buf, int maxlen) = NULL;
+long long (*watch_parse_size)(const char *str) = NULL;
+int (*watch_parse_cpulist)(const char *str, u_char *cpus, int ncpus) = NULL;
+int (*watch_parse_column)(const char *str, int column, double *val) = NULL;
+
+struct cell {
+	short start;
+	short end;
+};
+void (*watch_table_columns)(const wchar_t *header) = NULL;
+void (*watch_split_row)(const wchar_t *line, struct cell *cells) = NULL;
+int (*watch_parse_top)(const char *spec) = NULL;
+
+struct agerun {
+	short start;
+	short end;
+	u_int tick;
+};
+struct lineage {
+	u_int changed;
+	u_int churn;
+	struct agerun *runs;
+	int nruns;
+};
+void (*watch_update_runs)(struct lineage *la, const wchar_t *c,
+    const wchar_t *p, u_int tick, int hticks) = NULL;
 
 #define ASSERT(_cond)							\
 	if (!(_cond)) {							\
@@ -71,6 +96,133 @@ untabify_test2(void)
 	ASSERT(wcscmp(buf, L"        \u4e86\u89e3") == 0);
 }
 
+static void
+parse_size_test(void)
+{
+	ASSERT(watch_parse_size("0") == 0);
+	ASSERT(watch_parse_size("512") == 512);
+	ASSERT(watch_parse_size("4k") == 4096);
+	ASSERT(watch_parse_size("10M") == 10 * 1024 * 1024);
+	ASSERT(watch_parse_size("1G") == 1024 * 1024 * 1024);
+	ASSERT(watch_parse_size("") == -1);
+	ASSERT(watch_parse_size("-1") == -1);
+	ASSERT(watch_parse_size("10x") == -1);
+	ASSERT(watch_parse_size("10kk") == -1);
+	ASSERT(watch_parse_size("8589934591G") == 8589934591LL << 30);
+	ASSERT(watch_parse_size("8589934592G") == -1);	/* overflow */
+	ASSERT(watch_parse_size("9007199254740992k") == -1);
+	ASSERT(watch_parse_size("9223372036854775808") == -1);
+}
+
+static void
+parse_cpulist_test(void)
+{
+	u_char cpus[16];
+
+	ASSERT(watch_parse_cpulist("0", cpus, sizeof(cpus)) == 1);
+	ASSERT(cpus[0] == 1 && cpus[1] == 0);
+	ASSERT(watch_parse_cpulist("2-4,8", cpus, sizeof(cpus)) == 4);
+	ASSERT(cpus[1] == 0 && cpus[2] == 1 && cpus[4] == 1 && cpus[5] == 0);
+	ASSERT(cpus[8] == 1);
+	ASSERT(watch_parse_cpulist("1,1-2", cpus, sizeof(cpus)) == 2);
+	ASSERT(watch_parse_cpulist("15", cpus, sizeof(cpus)) == 1);
+	ASSERT(watch_parse_cpulist("16", cpus, sizeof(cpus)) == -1);
+	ASSERT(watch_parse_cpulist("3-1", cpus, sizeof(cpus)) == -1);
+	ASSERT(watch_parse_cpulist("1,", cpus, sizeof(cpus)) == -1);
+	ASSERT(watch_parse_cpulist("", cpus, sizeof(cpus)) == -1);
+}
+
+static void
+parse_column_test(void)
+{
+	double val;
+
+	ASSERT(watch_parse_column("eth0 1234 56", 2, &val) == 0);
+	ASSERT(val == 1234);
+	ASSERT(watch_parse_column("  eth0\t1234   -5.5e1", 3, &val) == 0);
+	ASSERT(val == -55);
+	ASSERT(watch_parse_column("load: 0.25,", 2, &val) == 0);
+	ASSERT(val == 0.25);
+	ASSERT(watch_parse_column("eth0 1234", 1, &val) == -1);
+	ASSERT(watch_parse_column("eth0 1234", 3, &val) == -1);
+	ASSERT(watch_parse_column("", 1, &val) == -1);
+}
+
+static void
+split_row_test(void)
+{
+	struct cell cells[4];
+
+	watch_table_columns(L"  PID USER     %CPU COMMAND");
+
+	/* the numbers aligned to the right, the last field until the end */
+	watch_split_row(L"    1 root      0.0 init -x\n", cells);
+	ASSERT(cells[0].start == 4 && cells[0].end == 5);
+	ASSERT(cells[1].start == 6 && cells[1].end == 10);
+	ASSERT(cells[2].start == 16 && cells[2].end == 19);
+	ASSERT(cells[3].start == 20 && cells[3].end == 27);
+
+	/* wider than the header, and an empty field */
+	watch_split_row(L" 3000          12.5 sshd", cells);
+	ASSERT(cells[0].start == 1 && cells[0].end == 5);
+	ASSERT(cells[1].start == cells[1].end);
+	ASSERT(cells[2].start == 15 && cells[2].end == 19);
+	ASSERT(cells[3].start == 20 && cells[3].end == 24);
+}
+
+static void
+parse_top_test(void)
+{
+	ASSERT(watch_parse_top("2") == 0);
+	ASSERT(watch_parse_top("2:10") == 0);
+	ASSERT(watch_parse_top("") == -1);
+	ASSERT(watch_parse_top("0") == -1);
+	ASSERT(watch_parse_top("-1") == -1);
+	ASSERT(watch_parse_top("2:") == -1);
+	ASSERT(watch_parse_top("2:0") == -1);
+	ASSERT(watch_parse_top("2:-5") == -1);
+	ASSERT(watch_parse_top("1:99999999999") == -1);
+	ASSERT(watch_parse_top("99999999999") == -1);
+	ASSERT(watch_parse_top("2x") == -1);
+	ASSERT(watch_parse_top("2:10x") == -1);
+	ASSERT(watch_parse_top("2:10:3") == -1);
+}
+
+static void
+update_runs_test(void)
+{
+	struct lineage la = { 0 };
+
+	watch_update_runs(&la, L"abcdef", L"abcxyz", 1, 10);
+	ASSERT(la.nruns == 1);
+	ASSERT(la.runs[0].start == 3 && la.runs[0].end == 6);
+	ASSERT(la.runs[0].tick == 1);
+
+	/* the middle is overwritten, longer than the previous */
+	watch_update_runs(&la, L"abcdXfgh", L"abcdef", 2, 10);
+	ASSERT(la.nruns == 4);
+	ASSERT(la.runs[0].start == 3 && la.runs[0].end == 4);
+	ASSERT(la.runs[0].tick == 1);
+	ASSERT(la.runs[1].start == 4 && la.runs[1].end == 5);
+	ASSERT(la.runs[1].tick == 2);
+	ASSERT(la.runs[2].start == 5 && la.runs[2].end == 6);
+	ASSERT(la.runs[2].tick == 1);
+	ASSERT(la.runs[3].start == 6 && la.runs[3].end == 8);
+	ASSERT(la.runs[3].tick == 2);
+
+	/* the runs older than the ticks are dropped */
+	watch_update_runs(&la, L"Abcdefgh", L"abcdefgh", 12, 10);
+	ASSERT(la.nruns == 1);
+	ASSERT(la.runs[0].start == 0 && la.runs[0].end == 1);
+
+	/* too many runs are joined up */
+	watch_update_runs(&la, L"a-b-c-d-e-f-g-h-i-j",
+	    L"a b c d e f g h i j", 13, 10);
+	ASSERT(la.nruns == 8);
+	ASSERT(la.runs[7].start == 15 && la.runs[7].end == 18);
+	free(la.runs);
+}
+
 #define	TEST(_f)				\
 	do {					\
 		printf("%-20s .. ", #_f);	\
@@ -97,9 +249,36 @@ main(int argc, char *argv[])
 	watch_untabify = dlsym(watch, "untabify");
 	if (watch_untabify == NULL)
 		errx(1, "dlsum(, untabify) failed");
+	watch_parse_size = dlsym(watch, "parse_size");
+	if (watch_parse_size == NULL)
+		errx(1, "dlsum(, parse_size) failed");
+	watch_parse_cpulist = dlsym(watch, "parse_cpulist");
+	if (watch_parse_cpulist == NULL)
+		errx(1, "dlsum(, parse_cpulist) failed");
+	watch_parse_column = dlsym(watch, "parse_column");
+	if (watch_parse_column == NULL)
+		errx(1, "dlsum(, parse_column) failed");
+	watch_table_columns = dlsym(watch, "table_columns");
+	if (watch_table_columns == NULL)
+		errx(1, "dlsum(, table_columns) failed");
+	watch_split_row = dlsym(watch, "split_row");
+	if (watch_split_row == NULL)
+		errx(1, "dlsum(, split_row) failed");
+	watch_parse_top = dlsym(watch, "parse_top");
+	if (watch_parse_top == NULL)
+		errx(1, "dlsum(, parse_top) failed");
+	watch_update_runs = dlsym(watch, "update_runs");
+	if (watch_update_runs == NULL)
+		errx(1, "dlsum(, update_runs) failed");
 
 	TEST(untabify_test);
 	TEST(untabify_test2);
+	TEST(parse_size_test);
+	TEST(parse_cpulist_test);
+	TEST(parse_column_test);
+	TEST(split_row_test);
+	TEST(parse_top_test);
+	TEST(update_runs_test);
 
 	exit(EXIT_SUCCESS);
 }